@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+#
+# Program a batch of radios from the images made by `eeprom.py -B`, one radio at a time.
+#
+#     Batch.sh <image dir> [firmware hex] [programmer]
+#
+# For each radio the firmware is only verified, and only written if it does not match, so radios that
+# already have this firmware (or one that is being redone) just get their EEPROM. The EEPROM goes on
+# with no erase, and avrdude reads it back to verify. Each image that goes on is logged in
+# <image dir>/programmed.log and skipped next time, so a batch can be stopped and picked up again.
+#
+
+dir=$1
+firmware=${2:-pr.hex}
+programmer=${3:-usbtiny}
+
+if [ -z "$dir" ] || [ ! -d "$dir" ]; then
+  echo "usage: $0 <image dir> [firmware hex, default pr.hex] [programmer, default usbtiny]"
+  exit 1
+fi
+
+if [ ! -f "$firmware" ]; then
+  echo "firmware $firmware not found"
+  exit 1
+fi
+
+avrdude="avrdude -qq -P usb -c $programmer -p attiny45 -B 15"
+log="$dir/programmed.log"
+touch "$log"
+
+for image in "$dir"/*.hex; do
+
+  name=`basename "$image"`
+
+  if grep -qx "$name" "$log"; then
+    continue
+  fi
+
+  # Keep trying the same image until it goes on, in case the radio was not seated right
+
+  while true; do
+
+    read -p "Next is $name. Put a radio on the programmer with the knob on and press enter (q to stop): " answer
+    [ "$answer" = "q" ] && exit 0
+
+    # Writing flash erases the chip, EEPROM too, so it has to come before the EEPROM.
+
+    if ! $avrdude -U flash:v:"$firmware":i 2>/dev/null; then
+      echo "Writing firmware..."
+      if ! $avrdude -U flash:w:"$firmware":i; then
+        echo "FAILED writing firmware for $name"
+        continue
+      fi
+    fi
+
+    if $avrdude -U eeprom:w:"$image":i; then
+      echo "$name" >> "$log"
+      echo "$name done"
+      break
+    fi
+
+    echo "FAILED writing $name"
+
+  done
+
+done
+
+echo "All images in $dir are programmed"
@@ -8,7 +8,7 @@
 #	- decode fields into human readable form
 
 from intelhex import IntelHex
-from struct import unpack_from, unpack
+from struct import unpack_from, unpack, calcsize
 from crcmod.predefined import Crc
 import sys
 
@@ -25,26 +25,61 @@ bandstr = {0:"87.5-108 MHz (USA, Europe)", 1:"76=108 MHz (Japan wide band)", 2:"
 spacestr= {0:"200 kHz (USA, Australia) ", 1:"100 kHz (Europe, Japan)", 2:" 50 kHz"}
 dempstr = {0:"75 us. Used in USA", 1:"50 us. Used in Europe, Australia, Japan"}
 
+# Bank B and the channel journal, must match the firmware. Bank A is at 0.
+
+bank_b_addr=0x60
+
+journal_addr=0x70
+journal_slots=4
+journal_record_size=4
+
+# Field telemetry counters from the telemetry build (make TELEMETRY=counters), must match main.c
+
+telemetry_addr=0x53
+telemetry_format='<HIHBBHB'
+telemetry_bandgap_mv=1100
+telemetry_adc_full_scale=1023
+
+# Awake time counters from the timing build (make timing), must match TimingBudget.h/.c
+
+timing_addr=0xc0
+timing_version=1
+timing_size=45
+timing_tick_ms=1.024
+timing_phases=["si4702_init", "si4702_enable", "si4702_tune", "Wake", "ADC sample", "TWI transfer"]
+
+# Param block flag bits, must match the firmware
+
+param_flag_strong_only=0x01
+param_flag_seek_set=0x02
+
 def calc_freq(band, spacing, chan):
 	b = base[band]
 	s = step[spacing]
 	return b + (float(chan) / s)
 
-def dump_freq(info, crc):
+def dump_freq(name, info, crc):
 
 	crc16 = Crc('crc-16')
 	crc16.update(info)
 
 	if (crc16.crcValue != crc):
 		print "%s: CRC mismatch" % name
+		return None
 	else:
-		(band, deemph, spacing, chan, vol) = unpack('<BBBHB8x', info)
+		(band, deemph, spacing, chan, vol, rssi, snr, impulse, flags, gen) = unpack('<BBBHBBBBBB3x', info)
 
 		print "    Band:        %02x = %s" % (band,   bandstr[band])
 		print "    Deemphasis:  %02x = %s" % (deemph, dempstr[deemph])
 		print "    Spacing:     %02x = %s" % (spacing,spacestr[spacing])
 		print "    Channel:    %.3d" % chan
 		print "    Volume:      %02d" % vol
+		seek_set = flags & param_flag_seek_set
+		print "    Seek RSSI:   %s" % (seek_set and ("%d" % rssi) or "default")
+		print "    Seek SNR:    %s" % (seek_set and ("%d" % snr) or "default")
+		print "    Seek count:  %s" % (seek_set and ("%d" % impulse) or "default")
+		print "    Strong only: %s" % ((flags & param_flag_strong_only) and "yes" or "no")
+		print "    Generation:  %d" % gen
 
 		try:
 			freq = calc_freq(band, spacing, chan)
@@ -52,30 +87,145 @@ def dump_freq(info, crc):
 			
 		except:	
 			print "%s: Cannot decode frequency" % name
+
+		return (band, spacing, gen)
+
+#
+# Print each journal record, and which one the firmware will power up on.
+# Records are seq, channel (little endian), crc-8 of the first 3 bytes.
+#
+def dump_journal(image, params):
+
+	newest = None
+
+	for slot in range(journal_slots):
+		offset = journal_addr + (slot * journal_record_size)
+		record = image[offset:offset + journal_record_size]
+		(seq, chan, crc) = unpack('<BHB', record)
+
+		crc8 = Crc('crc-8')
+		crc8.update(record[:3])
+
+		if crc8.crcValue != crc:
+			print "    Slot %d: empty" % slot
+			continue
+
+		print "    Slot %d: seq %3d channel %.3d" % (slot, seq, chan)
+
+		# Sequence numbers wrap, same rule as the firmware
+		if newest is None or ((seq - newest[0]) & 0xff) < 0x80:
+			newest = (seq, chan)
+
+	if newest is None:
+		print "    Journal empty, powers up on working channel"
+	else:
+		print "    Powers up on channel %.3d (seq %d)" % (newest[1], newest[0])
+		if params is not None:
+			try:
+				print "    Freqency=%03.02f Mhz (calculated)" % calc_freq(params[0], params[1], newest[1])
+			except:
+				print "Journal: Cannot decode frequency"
 		
-		
+
+#
+# Print the telemetry counters, if there are any. Erased or never written shows as empty.
+#
+def dump_telemetry(image):
+
+	size = calcsize(telemetry_format)
+	record = image[telemetry_addr:telemetry_addr + size]
+	(power_ons, play_minutes, seeks, saves, low_batteries, vcc_adc_max, crc) = unpack(telemetry_format, record)
+
+	print "---Telemetry"
+
+	crc8 = Crc('crc-8')
+	crc8.update(record[:-1])
+
+	if crc8.crcValue != crc:
+		print "    Empty (not a telemetry build, or never powered up)"
+		return
+
+	print "    Power ups:      %d" % power_ons
+	print "    Play time:      about %d:%02d (hours:minutes, approximate)" % (play_minutes / 60, play_minutes % 60)
+	print "    Seeks:          %d" % seeks
+	print "    Saves:          %d" % saves
+	print "    Low batteries:  %d" % low_batteries
+	if vcc_adc_max:
+		print "    Lowest Vcc:     %.2f V (ADC %d)" % (telemetry_bandgap_mv * telemetry_adc_full_scale / 1000.0 / vcc_adc_max, vcc_adc_max)
+	else:
+		print "    Lowest Vcc:     not seen yet"
+
+#
+# Print the awake time counters, if the image has them. Only the ATTINY45 has EEPROM up here.
+#
+def dump_timing(dump):
+
+	if dump.maxaddr() < timing_addr + timing_size - 1:
+		return
+
+	record = dump.tobinstr(start=timing_addr, end=timing_addr + timing_size - 1)
+	(version, awake, slept) = unpack_from('<BII', record)
+
+	if version != timing_version:
+		return
+
+	print "---Timing"
+
+	total = (awake * timing_tick_ms) + slept
+	print "    Awake:       %.1f s" % (awake * timing_tick_ms / 1000)
+	print "    Asleep:      %.1f s" % (slept / 1000.0)
+	if total:
+		print "    Awake per hour: %.1f s (%.3f%%)" % ((awake * timing_tick_ms) * 3600 / total, (awake * timing_tick_ms) * 100 / total)
+
+	for phase in range(len(timing_phases)):
+		(count, ticks) = unpack_from('<HI', record, 9 + (phase * 6))
+		ms = ticks * timing_tick_ms
+		print "    %-14s %6d times %10.1f ms total %8.2f ms each" % (timing_phases[phase] + ":", count, ms, count and (ms / count) or 0)
+
 dump=IntelHex(source)
+image=dump.tobinstr(start=0, end=journal_addr + (journal_slots * journal_record_size) - 1)
 
 # Unpack fields
 # 14 - String - Working station
 #  2 = HEX    - Working CRC
 # 14 - String - Factory station
 #  2 = HEX    - Factory CRC
+# Optional manufacturing record
 
-#payload = list(unpack_from('<14sH14sH17sBB2s13s17s', dump.tobinstr()))
-payload = list(unpack_from('<14sH', dump.tobinstr()))
+payload = list(unpack_from('<14sH14sH17sBB2s13s17s', image))
 
-#if not (eyecatcher in payload[9]):
-	#print "NOTE:Eyecatcher text string not found"
+if not (eyecatcher in payload[9]):
+	print "NOTE:Eyecatcher text string not found"
 
 
-print "---Working"
-dump_freq(payload[0], payload[1])
+print "---Working bank A"
+bank_a = dump_freq("Bank A", payload[0], payload[1])
+print "---Working bank B"
+bank_b = dump_freq("Bank B", *unpack_from('<14sH', image, bank_b_addr))
 print "---Factory"
-dump_freq(payload[2], payload[3])
+factory = dump_freq("Factory", payload[2], payload[3])
+
+# Same rule as the firmware, the newest good bank wins and ties go to A
+
+print "---In use"
+if bank_a is not None and (bank_b is None or ((bank_a[2] - bank_b[2]) & 0xff) < 0x80):
+	print "    Powers up on bank A"
+	working = bank_a
+elif bank_b is not None:
+	print "    Powers up on bank B"
+	working = bank_b
+else:
+	print "    Both banks bad, powers up on factory"
+	working = factory
+
+print "---Journal"
+dump_journal(image, working)
 
 print "SN: %s" % payload[4].strip('\000')
 print "WW: %d" % payload[5]
 print "YY: %d" % payload[6]
 print "Station: %s" % payload[7]
 print "Campaign: %s" % payload[8].strip('\000')
+
+dump_telemetry(image)
+dump_timing(dump)
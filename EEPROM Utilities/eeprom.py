@@ -3,24 +3,36 @@
 #
 # Utility to create eeprom images for Public Radio.
 #
-# EEPROM consists of 3 areas:
+# EEPROM consists of these areas:
 #
-# 1. running config. In practical terms the only attribute that changes
+# 1. running config, bank A at 0x00 and bank B at 0x60. In practical terms the only attribute that changes
 #    in normal use is the channel. However, we store all the soft attributes
-#    (band, channel spacing, de-emphasis, volume) in addition to the channel
-#    and protect the structure via CRC16. If CRC16 does not match, then entry
-#    is considererd corrupt, and factory values will be used.
-# 2. Factory config. Never written by the firmware. Used if the running config
-#    is corrupted (e.g. written with a low/failing battery), or if the user
+#    (band, channel spacing, de-emphasis, volume, seek thresholds) in addition
+#    to the channel and protect the structure via CRC16. If CRC16 does not match, then entry
+#    is considererd corrupt. The firmware saves into whichever bank it is not
+#    using with the generation byte one higher, and uses the newest bank with a
+#    good CRC. We write bank A with generation 0 and erase bank B, so a bank left
+#    over from a previous image can't win.
+# 2. Factory config. Never written by the firmware. Used if both running config banks
+#    are corrupted (e.g. written with a low/failing battery), or if the user
 #    requests a factory reset.
 # 3. Manufacturing data. Never accessed by firmware. Contains serial number,
 #    ISO week & year of manufacture, production test fixture identifier and
 #    field for any associated campaign (e.g. pledge drive, promotion, etc)
+# 4. Channel journal at 0x70. When the user saves a station, the firmware
+#    appends a small record here rather than rewriting the running config.
+#    The newest valid record overrides the channel in the running config.
+#    We always write this area erased so that stale records from a
+#    previous image can't override the channel we are programming.
+# 5. Scan cache at 0x80 (SCAN=cache builds, ATTINY45/85 only). With -x we
+#    write its count byte erased so the firmware scans again on first boot.
+#    The ATTINY25 has no EEPROM there, so it is left out by default. The
+#    firmware also scans again by itself if the band, spacing or deemphasis
+#    changed.
 #
 # Defaults to US settings unless otherwise specified.
 #
-# TODO: CLI parsing to set these.
-#       Make this pythonic, not procedural, if anyone cares.
+# TODO: Make this pythonic, not procedural, if anyone cares.
 #
 #
 # NOTE: you will need to install the crcmod package from here:
@@ -40,14 +52,21 @@ from struct import pack
 from math import modf
 from crcmod.predefined import Crc
 from getopt import getopt, GetoptError
+from csv import DictReader
 import sys
+import os
 
 #
-# All the following to be able to be set with getopt.
-# These defaults will do for testing purposes.
+# Defaults for the options below, see usage(). They will do for testing
+# purposes.
 #
 outfile=sys.stdout
 
+# batch mode, see make_batch()
+#
+batch=None
+outdir='.'
+
 
 # manufacturing data
 #
@@ -57,6 +76,20 @@ ts=""
 campaign=""
 eyecatcher='The Public Radio'
 
+# param banks and channel journal, must match the firmware. The telemetry
+# counters at 0x53 (telemetry build only) are left alone so they survive
+# reprogramming.
+#
+bank_b_addr=0x60
+param_block_size=16
+
+journal_addr=0x70
+journal_slots=4
+journal_record_size=4
+
+scan_cache_addr=0x80
+scan_cache=False
+
 # tuning info
 #
 freq=0.0
@@ -65,6 +98,27 @@ demphasis=0		# US 75uS
 spacing=0		# US 200KHz
 volume=0x0f		# max (0 dBFS)
 
+# seek thresholds, None means use the default for the band. We always set
+# param_flag_seek_set so the firmware uses exactly these, 0 included. Blocks
+# without the flag (older images, the programming jig) get the firmware's
+# compiled-in defaults.
+#
+seek_rssi=None		# SEEKTH (0-255)
+seek_snr=None		# SKSNR (0-15, bigger means fewer stops)
+seek_impulse=None	# SKCNT (0-15, bigger means fewer stops)
+strong_only=False	# Only stop on strong, clean stations
+
+# Per band (seek_rssi, seek_snr, seek_impulse) from SiLabs AN284. The
+# recommended settings for the wide US/Europe band, and the "more stations"
+# settings for the Japan bands where stations are fewer and weaker.
+#
+seek_defaults = {0: (0x19, 0x4, 0x8), 1: (0x0c, 0x4, 0x8), 2: (0x0c, 0x4, 0x8)}
+
+# param block flag bits, must match the firmware
+#
+param_flag_strong_only=0x01
+param_flag_seek_set=0x02
+
 #
 # Create a manufacturing record.
 #
@@ -73,11 +127,12 @@ def manuf_record(sn, ts, campaign):
 	yy = int(date.today().strftime('%g'))
 	return pack('17sBB2s13s17s', sn[:16], ww, yy, ts[:2], campaign[:12], eyecatcher)
 
-option_list='MS:T:C:f:b:d:s:v:'
+option_list='MS:T:C:f:b:d:s:v:r:n:i:qxB:o:'
 
 def usage():
 	print r'''Usage: eeprom -f <freq> [-b <n>] [-d <n>] [-s <n>] [-v <n>]
-		[-m [-S <sn>] [-T <ts>] [-C <campaign>]]
+		[-r <n>] [-n <n>] [-i <n>] [-q] [-x]
+		[-M [-S <sn>] [-T <ts>] [-C <campaign>]]
 		-f <n>	Specify the frequency in MHz
 		-b <n>	Specify the band (0=87.5-108, 1=76-108, 2=76-90,
 			default = 0)
@@ -85,11 +140,21 @@ def usage():
 		-s <n>	Specify the channel spacing (0=200KHz, 1=100KHz,
 			2=50KHz, default = 0)
 		-v <n>	Specify max volume (0-15, default 15)
+		-r <n>	Specify seek RSSI threshold (0-255, default per band)
+		-n <n>	Specify seek SNR threshold (0-15, default per band)
+		-i <n>	Specify seek impulse count threshold (0-15, default
+			per band)
+		-q	Seek only stops on strong stations
+		-x	Also erase the scan cache at 0x80 (ATTINY45/85 only)
 		-M	Append a manufacturing record (only to be used in
 			production test fixtures)
 		-S <sn>	Specify a serial number (<= 16 characters in length)
 		-T <ts> Specify a test station identifier (<= 2 characters)
-		-C <c>	Specify a campaign (<= 12 characters in length)'''
+		-C <c>	Specify a campaign (<= 12 characters in length)
+       eeprom -B <csv> [-o <dir>] [any of the above as defaults]
+		-B <csv> Write one image per row of a CSV file, see
+			make_batch() for the columns
+		-o <dir> Directory for the batch images (default .)'''
 	sys.exit(1)
 
 try:
@@ -109,6 +174,16 @@ for o, a in opts:
 		spacing = int(a)
 	elif o == '-v':
 		volume = int(a)
+	elif o == '-r':
+		seek_rssi = int(a)
+	elif o == '-n':
+		seek_snr = int(a)
+	elif o == '-i':
+		seek_impulse = int(a)
+	elif o == '-q':
+		strong_only = True
+	elif o == '-x':
+		scan_cache = True
 	elif o == '-M':
 		manuf = True
 	elif o == '-S':
@@ -117,16 +192,13 @@ for o, a in opts:
 		ts = a
 	elif o == '-C':
 		campaign = a
+	elif o == '-B':
+		batch = a
+	elif o == '-o':
+		outdir = a
 	else:
 		usage()
 
-if band < 0 or band > 2 or demphasis < 0 or demphasis > 1 or spacing < 0 or spacing > 2 or volume < 0 or volume > 15:
-	usage()
-
-if freq < 76.0 or freq > 108.0:
-	print "Frequency unspecified or out of bounds"
-	usage()
-
 #
 # calculate channel # based on freq, band & channel spacing.
 # Note that we force the floating point arithmetic to round
@@ -135,38 +207,154 @@ if freq < 76.0 or freq > 108.0:
 base = {0: 87.5, 1: 76, 2: 76}
 step = {0: 5, 1: 10, 2: 20}
 
-try:
-	chan = round((freq - base[band]) * step[spacing], 4)
-except:
-	print "Illegal band and/or spacing"
-	sys.exit(1)
+#
+# Build the whole EEPROM image for one radio. Raises ValueError with the
+# reason if the settings are no good.
+#
+def make_image(freq, band, demphasis, spacing, volume, seek_rssi, seek_snr, seek_impulse, strong_only, manuf, sn, ts, campaign, scan_cache):
+
+	if band < 0 or band > 2 or demphasis < 0 or demphasis > 1 or spacing < 0 or spacing > 2 or volume < 0 or volume > 15:
+		raise ValueError("Band, deemphasis, spacing, or volume out of range")
+
+	(d_rssi, d_snr, d_impulse) = seek_defaults[band]
+	if seek_rssi is None:
+		seek_rssi = d_rssi
+	if seek_snr is None:
+		seek_snr = d_snr
+	if seek_impulse is None:
+		seek_impulse = d_impulse
+
+	if seek_rssi < 0 or seek_rssi > 255 or seek_snr < 0 or seek_snr > 15 or seek_impulse < 0 or seek_impulse > 15:
+		raise ValueError("Seek threshold out of range")
+
+	flags = param_flag_seek_set
+	if strong_only:
+		flags = flags | param_flag_strong_only
+
+	if freq < 76.0 or freq > 108.0:
+		raise ValueError("Frequency unspecified or out of bounds")
 
-if modf(chan)[0] != 0.0:
-	print "Illegal freq/spacing combo"
-	sys.exit(2)
+	try:
+		chan = round((freq - base[band]) * step[spacing], 4)
+	except:
+		raise ValueError("Illegal band and/or spacing")
 
-chan = int(chan)
+	if modf(chan)[0] != 0.0:
+		raise ValueError("Illegal freq/spacing combo")
 
-# First create the data without the checksum, note that we specify
-# little-endianness for multi-byte values.
+	chan = int(chan)
 
-t = pack('<BBBHB8x', band, demphasis, spacing, chan, volume)
+	# First create the data without the checksum, note that we specify
+	# little-endianness for multi-byte values.
 
-# Calculate and append a crc-16 checksum
-crc16 = Crc('crc-16')
-crc16.update(t)
+	# The generation byte (0 here) tells the firmware which bank is newer.
 
-t = t + pack('<H', crc16.crcValue)
+	t = pack('<BBBHBBBBBB3x', band, demphasis, spacing, chan, volume, seek_rssi, seek_snr, seek_impulse, flags, 0)
 
+	# Calculate and append a crc-16 checksum
+	crc16 = Crc('crc-16')
+	crc16.update(t)
+
+	t = t + pack('<H', crc16.crcValue)
+
+	#
+	# Simply create a hex file with the concatenation of two tuning structures (t)
+	# for bank A and factory, and optionally one manufacturing structure, then an
+	# erased bank B and journal, and the erased scan cache count if asked.
+	#
+	eeprom = t + t
+
+	if manuf:
+		eeprom = eeprom + manuf_record(sn, ts, campaign)
+
+	hexfile = IntelHex()
+	hexfile.puts(0, eeprom)
+	hexfile.puts(bank_b_addr, '\xff' * param_block_size)
+	hexfile.puts(journal_addr, '\xff' * (journal_slots * journal_record_size))
+	if scan_cache:
+		hexfile.puts(scan_cache_addr, '\xff')
+
+	return hexfile
+
+#
+# Batch mode. One image per CSV row, named after the serial number (or the
+# row number if there isn't one). The first line names the columns, any of...
 #
-# Simply create a hex file with the concatenation of two tuning structures (t)
-# and optionally one manufacturing structure, then write the result.
+#	freq band deemphasis spacing volume rssi snr impulse strong sn ts campaign
 #
-eeprom = t + t
+# ...in any order. A missing column or empty cell gets the value from the
+# command line, so the command line sets the defaults for the whole batch.
+# strong is 1 or 0. Every row is checked before any file is written, so a
+# bad row doesn't leave half a batch behind.
+#
+def make_batch(csvfile, outdir):
+
+	images = []
+	names = set()
+
+	reader = DictReader(open(csvfile, 'rb'))
+
+	for row in reader:
+
+		line = reader.line_num
+
+		def field(name, default, convert):
+			value = (row.get(name) or '').strip()
+			if value == '':
+				return default
+			try:
+				return convert(value)
+			except ValueError:
+				print "%s line %d: bad %s '%s'" % (csvfile, line, name, value)
+				sys.exit(1)
 
-if manuf:
-	eeprom = eeprom + manuf_record(sn, ts, campaign)
+		unit_sn = field('sn', sn, str)
+
+		try:
+			image = make_image(
+				field('freq', freq, float),
+				field('band', band, int),
+				field('deemphasis', demphasis, int),
+				field('spacing', spacing, int),
+				field('volume', volume, int),
+				field('rssi', seek_rssi, int),
+				field('snr', seek_snr, int),
+				field('impulse', seek_impulse, int),
+				field('strong', strong_only, lambda v: int(v) != 0),
+				manuf,
+				unit_sn,
+				field('ts', ts, str),
+				field('campaign', campaign, str),
+				scan_cache)
+		except ValueError as err:
+			print "%s line %d: %s" % (csvfile, line, err)
+			sys.exit(1)
+
+		name = unit_sn and ("%s.hex" % unit_sn.replace(os.sep, '_')) or ("unit-%04d.hex" % (len(images) + 1))
+
+		if name in names:
+			print "%s line %d: %s is in the batch twice" % (csvfile, line, name)
+			sys.exit(1)
+
+		names.add(name)
+		images.append((name, image))
+
+	if not os.path.isdir(outdir):
+		os.makedirs(outdir)
+
+	for (name, image) in images:
+		image.write_hex_file(os.path.join(outdir, name))
+
+	print "Wrote %d images to %s" % (len(images), outdir)
+
+if batch:
+	make_batch(batch, outdir)
+	sys.exit(0)
+
+try:
+	hexfile = make_image(freq, band, demphasis, spacing, volume, seek_rssi, seek_snr, seek_impulse, strong_only, manuf, sn, ts, campaign, scan_cache)
+except ValueError as err:
+	print str(err)
+	usage()
 
-hexfile = IntelHex()
-hexfile.puts(0, eeprom)
 hexfile.write_hex_file(outfile)
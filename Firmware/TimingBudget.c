@@ -0,0 +1,190 @@
+/***
+
+Awake time instrumentation for the diagnostic build (make timing)
+
+The clock is Timer0 free running at clk/1024, the same rate idleFor() uses, so a tick is 1.024ms at 1MHz.
+Timer0 stops in power down and ADC noise reduction sleep because clk_IO is stopped, so it only counts
+while the CPU is clocked (running or in idle). That is exactly the awake time we want, but note that
+the ADC phase only shows the time around the conversions and not the conversions themselves. 
+
+A tick is coarse compared to a TWI burst, but since the phases start at random points in a tick the
+totals come out right on average over many counts. 
+
+The main thread runs with interrupts off, so the overflow ISR might be late. We also check for a pending 
+overflow every time we read the clock. Over 262ms with interrupts off and no reading would lose one.  
+
+EEPROM record at EEPROM_TIMING (all little endian, must match dump_eeprom.py)...
+
+    0       Version, TIMING_VERSION. Anything else means start from zero
+    1-4     Total awake ticks
+    5-8     Total asleep in sleepFor(), in ms. Nominal, so a button wake counts as the full time
+    9-44    For each phase, a 2 byte count and 4 byte total ticks
+
+This code is processor specific so may not work on other chips besides ATTINY25/45/85.
+
+***/
+
+// Compiles to nothing unless this is the timing build
+
+#ifdef TIMING_BUDGET
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/power.h>
+#include <string.h>
+
+#include "profile.h"
+
+#include "TimingBudget.h"
+
+#define TIMING_VERSION  1
+
+typedef struct {
+    uint16_t count;
+    uint32_t ticks;
+} __attribute__((packed)) timing_phase;
+
+typedef struct {
+    uint8_t      version;
+    uint32_t     awake;
+    uint32_t     slept_ms;
+    timing_phase phase[TIMING_PHASES];
+} __attribute__((packed)) timing_record;
+
+static timing_record timing;
+
+static volatile uint32_t timing_base;       // Clock at the last time TCNT0 was 0 
+
+static uint32_t timing_saved;               // Clock when awake was last added into the record
+
+static uint32_t timing_started[TIMING_PHASES];
+
+static uint8_t timing_open;                 // One bit per phase with timing_begin() but no timing_end() yet
+
+static uint8_t timing_running;
+
+ISR( TIM0_OVF_vect ) {
+    timing_base += 256;
+}    
+
+static void timing_clock_on(void) {
+    
+    power_timer0_enable();                  // main() powers it down, and it never goes off again in this build
+    
+    TCCR0A = 0;                             // Normal mode
+    TCNT0 = 0;
+    TIFR = _BV( TOV0 );
+    TIMSK |= _BV( TOIE0 );
+    TCCR0B = _BV( CS02 ) | _BV( CS00 );     // clk/1024
+    
+}
+
+static uint32_t timing_now(void) {
+    
+    uint8_t sreg = SREG;
+    cli();
+    
+    uint8_t t = TCNT0;
+    
+    if (TIFR & _BV( TOV0 )) {               // Overflowed but ISR has not run yet
+        timing_base += 256;
+        TIFR = _BV( TOV0 );
+        t = TCNT0;
+    }
+    
+    uint32_t now = timing_base + t;
+    
+    SREG = sreg;
+    
+    return now;
+    
+}
+
+void timing_start(void) {
+    
+    eeprom_read_block( &timing , EEPROM_TIMING , sizeof( timing ) );
+    
+    if (timing.version != TIMING_VERSION) {          // Erased EEPROM or older layout 
+        
+        memset( &timing , 0x00 , sizeof( timing ) );
+        
+        timing.version = TIMING_VERSION;
+        
+    }
+    
+    timing_base = 0;
+    timing_saved = 0;
+    timing_open = 0;
+    
+    timing_clock_on();
+    
+    timing_running = 1;
+    
+}
+
+void timing_begin( uint8_t phase ) {
+    
+    if (!timing_running) return;
+    
+    timing_started[phase] = timing_now();
+    
+    timing_open |= _BV( phase );
+    
+}
+
+void timing_end( uint8_t phase ) {
+    
+    if (!(timing_open & _BV( phase ))) return;
+    
+    timing_open &= ~_BV( phase );
+    
+    timing.phase[phase].count++;
+    timing.phase[phase].ticks += timing_now() - timing_started[phase];
+    
+}
+
+void timing_idle_start(void) {
+    
+    if (!timing_running) return;
+    
+    TIMSK &= ~_BV( TOIE0 );
+    
+    timing_base = timing_now();             // Fold in the current count since idleFor() will zero TCNT0
+    
+}
+
+void timing_idle_end( uint16_t ticks ) {
+    
+    if (!timing_running) return;
+    
+    timing_base += ticks;
+    
+    timing_clock_on();
+    
+}
+
+void timing_slept( uint8_t howlong ) {
+    
+    // WDP3 is not next to the other prescaler bits
+    
+    uint8_t wdp = (howlong & ( _BV( WDP2 ) | _BV( WDP1 ) | _BV( WDP0 ) )) | ( (howlong & _BV( WDP3 )) ? 8 : 0 );
+    
+    timing.slept_ms += 16UL << wdp;
+    
+}
+
+void timing_save(void) {
+    
+    if (!timing_running) return;
+    
+    uint32_t now = timing_now();
+    
+    timing.awake += now - timing_saved;
+    timing_saved = now;
+    
+    eeprom_update_block( &timing , (void *) EEPROM_TIMING , sizeof( timing ) );
+    
+}
+
+#endif
@@ -0,0 +1,69 @@
+/***
+
+Awake time instrumentation for the diagnostic build (make timing)
+
+Counts how long the CPU is clocked in each phase, so we can see where the power goes instead of guessing.
+Results are kept in EEPROM at EEPROM_TIMING and dump_eeprom.py decodes them. 
+
+Only built with TIMING_BUDGET defined, otherwise all of these compile to nothing. 
+Needs the 256 byte EEPROM of the ATTINY45. 
+
+This code assumes default clock speed of 1MHz.
+
+***/
+
+#include <inttypes.h>
+
+// Phases. Must match dump_eeprom.py. Phases can nest (TWI transfers happen inside init, enable, and tune)
+// so each one counts all of its own time including anything inside it. 
+
+#define TIMING_INIT     0       // si4702_init()
+#define TIMING_ENABLE   1       // si4702_enable()
+#define TIMING_TUNE     2       // si4702_tune()
+#define TIMING_WAKE     3       // Awake between one sleepFor() and the next
+#define TIMING_ADC      4       // sampleADC()
+#define TIMING_TWI      5       // Each TWI read or write burst
+
+#define TIMING_PHASES   6
+
+#ifdef TIMING_BUDGET
+
+#define EEPROM_TIMING   ((const uint8_t *)0xc0)     // Above the scan cache, must match dump_eeprom.py
+
+#if E2END < 0xff
+    #error TIMING_BUDGET needs the 256 byte EEPROM of an ATTINY45 or bigger
+#endif
+
+// Load the totals so far from EEPROM and start Timer0 free running as the clock. 
+// Timer0 is only shared with idleFor(), which must call timing_idle_start() and timing_idle_end() around its use.
+
+void timing_start(void);
+
+void timing_begin( uint8_t phase );
+void timing_end( uint8_t phase );           // Does nothing if timing_begin() was not called first
+
+// idleFor() uses Timer0 itself, so it gives it back afterwards and tells us how many ticks it idled  
+
+void timing_idle_start(void);
+void timing_idle_end( uint16_t ticks );
+
+// Add the nominal length of a sleepFor() to the asleep total. 
+
+void timing_slept( uint8_t howlong );
+
+// Write the totals to EEPROM. Only changed bytes are written. This is a blocking write, so main.c only calls it
+// through timingSave(), which flushes the EEPROM write queue first.
+ 
+void timing_save(void);
+
+#else
+
+#define timing_start()
+#define timing_begin(phase)
+#define timing_end(phase)
+#define timing_idle_start()
+#define timing_idle_end(ticks)
+#define timing_slept(howlong)
+#define timing_save()
+
+#endif
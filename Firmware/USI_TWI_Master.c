@@ -27,11 +27,10 @@
 *
 ****************************************************************************/
 
-#define	F_CPU	1000000UL	/* Hack until we fix things the right way (tm) */
-
-
+#include "profile.h"
 
 #include <avr/io.h>
+#include <avr/power.h>
 #include "USI_TWI_Master.h"
 #include <util/delay.h>
 
@@ -42,6 +41,10 @@
 #define TBI(port,bit) (port&_BV(bit))
 
 
+#ifndef TWI_USI_HARDWARE
+
+// Bitbang version. Does not use the USI hardware at all, so SDA and SCL could be moved to any pins.
+
 // These are open collector signals, so never drive high - only drive low or pull high
 
 static inline void sda_drive_low(void) {
@@ -82,6 +85,11 @@ void USI_TWI_Master_Initialise( void )
   // This leaves us with both SCL and SDA high, which is an idle state  
 }
 
+// Bitbang never uses the USI, so it just stays powered down
+
+#define USI_TWI_Power_On()
+#define USI_TWI_Power_Off()
+
 
 // Write a byte out to the slave and look for ACK bit
 // Assumes SCL low, SDA doesn't matter
@@ -133,13 +141,13 @@ static unsigned char USI_TWI_Write_Byte( unsigned char data ) {
         
 }
 
-// Read a byte from the slave and send ACK bit
+// Read a byte from the slave and send ACK bit (or NACK if ack=0 because this is the last byte)
 // Assumes SCL low, returns with SCL low
 // Assumed SDA pulled high
 
 // Returns 0=success, SDA high, SCL high
 
-static unsigned char USI_TWI_Read_Byte(void) {
+static unsigned char USI_TWI_Read_Byte(uint8_t ack) {
           
     unsigned char data=0;
     
@@ -169,8 +177,13 @@ static unsigned char USI_TWI_Read_Byte(void) {
     //the controller IC must drive an acknowledge (SDIO = 0)
     //if an additional byte of data will be requested. Data
     //transfer ends with the STOP condition.         
+    
+    // If we ACK the last byte then the slave will start driving the next one and can
+    // hold SDA low right through our STOP, so leave SDA high (NACK) on the last one.
 
-    sda_drive_low();            // Pull SDA high so we can see if the salve is driving low
+    if (ack) {
+        sda_drive_low();            // ACK
+    }        
     _delay_us(BIT_TIME_US);     // Not needed, but so we can see what is happening on the scope       
     scl_pull_high();            // Clock out the ACK bit    
     _delay_us(BIT_TIME_US);
@@ -219,6 +232,171 @@ static unsigned char USI_TWI_Start( unsigned char addr , unsigned char readFlag)
         
 }    
 
+// Data transfer ends with the STOP condition 
+// (rising edge of SDIO while SCLK is high). 
+// Assumes SCL low on entry. Exits with bus idle.
+
+static void USI_TWI_Stop( void ) {
+    
+    sda_drive_low();
+    scl_pull_high();
+    _delay_us(BIT_TIME_US);
+    
+    sda_pull_high();
+    _delay_us(BIT_TIME_US);
+    
+}    
+
+#else
+
+// USI hardware version, based on AVR310. 
+// The USI shift register and 4-bit counter clock the bits in and out, we just strobe SCL.
+// Each edge only needs to be held for the T2_TWI/T4_TWI minimums rather than BIT_TIME_US, so bursts are much shorter.
+// Note that in two-wire mode the USI drives the pins open drain with DDR set, so the port pull-ups are not active
+// while driving. This mode needs external pull-ups on SDA and SCL, which is why bitbang stays the default.
+
+// USISR values to clear all flags and preload the counter so it overflows after 8 data bits or 1 (N)ACK bit (2 edges per bit)
+
+#define USISR_8BIT  ( _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC) | (0x0 << USICNT0) )
+#define USISR_1BIT  ( _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC) | (0xE << USICNT0) )
+
+// Two-wire mode, software clock strobe, toggle SCL. Writing this to USICR generates one SCL edge.
+
+#define USICR_STROBE ( _BV(USIWM1) | _BV(USICS1) | _BV(USICLK) | _BV(USITC) )
+
+/*---------------------------------------------------------------
+ USI TWI single master initialization function
+---------------------------------------------------------------*/
+void USI_TWI_Master_Initialise( void )
+{
+    SBI( PORT_USI , PIN_USI_SDA );          // Release SDA
+    SBI( PORT_USI , PIN_USI_SCL );          // Release SCL
+    
+    SBI( DDR_USI , PIN_USI_SCL );           // Outputs, the USI makes them open drain
+    SBI( DDR_USI , PIN_USI_SDA );
+    
+    USIDR = 0xff;                           // Preload data register so SDA is released
+    USICR = _BV(USIWM1) | _BV(USICS1) | _BV(USICLK);          // Two-wire mode, software clock strobe, no interrupts
+    USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC);      // Clear flags and counter
+    
+    // This leaves us with both SCL and SDA high, which is an idle state  
+}
+
+// The USI is powered down with PRR between transfers (see main.c) and has to be set up again after. 
+// While it is off the pins are released so the external pull-ups hold the bus idle.
+
+static void USI_TWI_Power_On( void ) {
+    
+    power_usi_enable();
+    USI_TWI_Master_Initialise();
+    
+}
+
+static void USI_TWI_Power_Off( void ) {
+    
+    USICR = 0;                              // Pins back to the port
+    CBI( DDR_USI , PIN_USI_SCL );
+    CBI( DDR_USI , PIN_USI_SDA );
+    power_usi_disable();
+    
+}
+
+// Clock bits in or out of USIDR until the counter overflows
+// Returns whatever ended up in USIDR, and leaves SDA released and driven as output
+
+static unsigned char USI_TWI_Master_Transfer( unsigned char usisr ) {
+    
+    USISR = usisr;
+    
+    do {
+        _delay_us( T2_TWI );
+        USICR = USICR_STROBE;                       // Positive SCL edge
+        while ( !TBI( PIN_USI , PIN_USI_SCL ) );    // Wait for SCL to go high (slave could be stretching)
+        _delay_us( T4_TWI );
+        USICR = USICR_STROBE;                       // Negative SCL edge
+    } while ( !TBI( USISR , USIOIF ) );             // Until counter overflows
+    
+    _delay_us( T2_TWI );
+    
+    unsigned char data = USIDR;
+    
+    USIDR = 0xff;                                   // Release SDA
+    SBI( DDR_USI , PIN_USI_SDA );                   // SDA back to output
+    
+    return data;
+    
+}
+
+// Write a byte out to the slave and look for ACK bit
+// Assumes SCL low, returns with SCL low
+// Returns 0=success
+
+static unsigned char USI_TWI_Write_Byte( unsigned char data ) {
+    
+    CBI( PORT_USI , PIN_USI_SCL );                  // Pull SCL low
+    USIDR = data;
+    USI_TWI_Master_Transfer( USISR_8BIT );          // Shift out the byte
+    
+    CBI( DDR_USI , PIN_USI_SDA );                   // SDA input so we can see the ACK
+    
+    return USI_TWI_Master_Transfer( USISR_1BIT ) & _BV( TWI_NACK_BIT );
+    
+}    
+
+// Read a byte from the slave and send ACK bit (or NACK if ack=0 because this is the last byte)
+// Assumes SCL low, returns with SCL low
+
+static unsigned char USI_TWI_Read_Byte( uint8_t ack ) {
+    
+    CBI( DDR_USI , PIN_USI_SDA );                   // SDA input so slave can drive it
+    
+    unsigned char data = USI_TWI_Master_Transfer( USISR_8BIT );
+    
+    USIDR = ack ? 0x00 : 0xff;                      // ACK is SDA low
+    USI_TWI_Master_Transfer( USISR_1BIT );
+    
+    return data;
+    
+}    
+
+// WriteFlag=0 leaves in read mode
+// WriteFlag=1 leaves in write mode
+// Returns 0 on success, 1 if no ACK bit received.
+// Assumes bus idle on entry (SCL and SDA high) 
+// Returns with SCL low
+
+static unsigned char USI_TWI_Start( unsigned char addr , unsigned char readFlag) {
+    
+    SBI( PORT_USI , PIN_USI_SCL );                  // Release SCL
+    while ( !TBI( PIN_USI , PIN_USI_SCL ) );        // Make sure it is really high
+    _delay_us( T2_TWI );
+    
+    CBI( PORT_USI , PIN_USI_SDA );                  // Falling SDA while SCL high is START
+    _delay_us( T4_TWI );
+    CBI( PORT_USI , PIN_USI_SCL );
+    SBI( PORT_USI , PIN_USI_SDA );                  // Let USIDR control SDA from now on
+    
+    return USI_TWI_Write_Byte( (addr << 1) | readFlag );
+    
+}    
+
+// Data transfer ends with the STOP condition 
+// (rising edge of SDIO while SCLK is high). 
+// Assumes SCL low on entry. Exits with bus idle.
+
+static void USI_TWI_Stop( void ) {
+    
+    CBI( PORT_USI , PIN_USI_SDA );                  // Pull SDA low
+    SBI( PORT_USI , PIN_USI_SCL );                  // Release SCL
+    while ( !TBI( PIN_USI , PIN_USI_SCL ) );        // Wait for SCL to go high
+    _delay_us( T4_TWI );
+    SBI( PORT_USI , PIN_USI_SDA );                  // Release SDA
+    _delay_us( T2_TWI );
+    
+}    
+
+#endif
+
 
 // Write the bytes pointed to by buffer
 // addr is the chip bus address
@@ -227,6 +405,8 @@ static unsigned char USI_TWI_Start( unsigned char addr , unsigned char readFlag)
 
 unsigned char USI_TWI_Write_Data(unsigned char addr, const uint8_t *buffer , uint8_t count)
 {
+    
+    USI_TWI_Power_On();
         
     USI_TWI_Start( addr , 0 );      // TODO: check for error
     
@@ -239,20 +419,14 @@ unsigned char USI_TWI_Write_Data(unsigned char addr, const uint8_t *buffer , uin
         
     }
     
-    // Data transfer ends with the STOP condition 
-    // (rising edge of SDIO while SCLK is high). 
-    
     // TODO: Is this Really needed? Can we just do repeat starts and save this code? Spec is vague if address is reset on start. 
     
-    sda_drive_low();
-    scl_pull_high();
-    _delay_us(BIT_TIME_US);
-    
-    sda_pull_high();
-    _delay_us(BIT_TIME_US);
+    USI_TWI_Stop();
         
     // End transaction with bus in idle
     
+    USI_TWI_Power_Off();
+    
     return(0);
     
 }
@@ -266,31 +440,26 @@ unsigned char USI_TWI_Write_Data(unsigned char addr, const uint8_t *buffer , uin
 unsigned char USI_TWI_Read_Data(unsigned char addr, uint8_t *buffer , uint8_t count)
 {
     
+    USI_TWI_Power_On();
+    
     USI_TWI_Start( addr , 1 );      // TODO: check for error
     
     while (count--) {
         
-        *buffer = USI_TWI_Read_Byte();
+        *buffer = USI_TWI_Read_Byte( count );      // ACK all but the last byte
         
         buffer++;
         
     }
     
-    // Data transfer ends with the STOP condition 
-    // (rising edge of SDIO while SCLK is high). 
-    
     // TODO: Is this Really needed? Can we just do repeat starts and save this code? Spec is vague if address is reset on start. 
-    // TODO: Make stop function to save space
-    
-    sda_drive_low();
-    scl_pull_high();
-    _delay_us(BIT_TIME_US);
     
-    sda_pull_high();
-    _delay_us(BIT_TIME_US);
+    USI_TWI_Stop();
         
     // End transaction with bus in idle
     
+    USI_TWI_Power_Off();
+    
     return(0);
     
 }
@@ -301,66 +470,4 @@ unsigned char USI_TWI_Read_Data(unsigned char addr, uint8_t *buffer , uint8_t co
 unsigned char USI_TWI_Start_Transceiver_With_Data(unsigned char c, unsigned char *d, unsigned char l) {
     return(0);
 } 
-*/   
-
-/*---------------------------------------------------------------
- Core function for shifting data in and out from the USI.
- Data to be sent has to be placed into the USIDR prior to calling
- this function. Data read, will be returned from the function.
----------------------------------------------------------------*/
-
-/*
-unsigned char USI_TWI_Master_Transfer( unsigned char temp )
-{
-  USISR = temp;                                     // Set USISR according to temp.
-                                                    // Prepare clocking.
-  temp  =  (0<<USISIE)|(0<<USIOIE)|                 // Interrupts disabled
-           (1<<USIWM1)|(0<<USIWM0)|                 // Set USI in Two-wire mode.
-           (1<<USICS1)|(0<<USICS0)|(1<<USICLK)|     // Software clock strobe as source.
-           (1<<USITC);                              // Toggle Clock Port.
-  do
-  {
-    _delay_us( T2_TWI/4 );              
-    USICR = temp;                          // Generate positve SCL edge.
-    while( !(PIN_USI & (1<<PIN_USI_SCL)) );// Wait for SCL to go high.
-    _delay_us( T4_TWI/4 );              
-    USICR = temp;                          // Generate negative SCL edge.
-  }while( !(USISR & (1<<USIOIF)) );        // Check for transfer complete.
-  
-  _delay_us( T2_TWI/4 );                
-  temp  = USIDR;                           // Read out data.
-  USIDR = 0xFF;                            // Release SDA.
-  DDR_USI |= (1<<PIN_USI_SDA);             // Enable SDA as output.
-
-  return temp;                             // Return the data from the USIDR
-}
-
-
 */
-
-/*---------------------------------------------------------------
- Function for generating a TWI Stop Condition. Used to release 
- the TWI bus.
----------------------------------------------------------------*/
-
-/*
-unsigned char USI_TWI_Master_Stop( void )
-{
-  PORT_USI &= ~(1<<PIN_USI_SDA);           // Pull SDA low.
-  PORT_USI |= (1<<PIN_USI_SCL);            // Release SCL.
-  while( !(PIN_USI & (1<<PIN_USI_SCL)) );  // Wait for SCL to go high.
-  _delay_us( T4_TWI/4 );               
-  PORT_USI |= (1<<PIN_USI_SDA);            // Release SDA.
-  _delay_us( T2_TWI/4 );                
-  
-#ifdef SIGNAL_VERIFY
-  if( !(USISR & (1<<USIPF)) )
-  {
-    USI_TWI_state.errorState = USI_TWI_MISSING_STOP_CON;    
-    return (FALSE);
-  }
-#endif
-
-  return (TRUE);
-}
-*/
\ No newline at end of file
@@ -27,12 +27,17 @@
 *
 ****************************************************************************/
     #include<avr/io.h> 
+    #include "profile.h"
 //********** Defines **********//
 
+// Define to use the USI shift register and counter rather than bitbanging every bit.
+// Needs external pull-ups on SDA and SCL. Can also be set from the Makefile with `make TWI=usi`.
+//#define TWI_USI_HARDWARE
+
 // Defines controlling timing limits
 #define TWI_FAST_MODE
 
-#define SYS_CLK   1000.0  // [kHz]
+#define SYS_CLK   (F_CPU / 1000.0)  // [kHz], from profile.h
 
 #ifdef TWI_FAST_MODE               // TWI FAST mode timing limits. SCL = 100-400kHz
   #define T2_TWI    ((SYS_CLK *1300) /1000000) +1 // >1,3us
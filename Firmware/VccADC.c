@@ -16,15 +16,37 @@ https://wp.josh.com/2014/11/06/battery-fuel-guage-with-zero-parts-and-zero-pins-
 ***/
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/power.h>
 
-#define F_CPU 1000000
+#include "profile.h"
 
 #include <util/delay.h>
 
+#include "VccADC.h"
+#include "TimingBudget.h"
+
+// Conversions are done in ADC Noise Reduction sleep. The CPU is stopped (so quieter and less power)
+// and the conversion complete interrupt wakes us back up. Nothing to do in the ISR. 
+
+EMPTY_INTERRUPT( ADC_vect );
+
+// The first conversion takes 25 ADC clocks, the rest take 13. At 125kHz this many add up to just over the 1ms
+// the bandgap needs to settle, so we can sleep through the settling time rather than spin.
+
+#define ADC_SETTLE_CONVERSIONS 10
+
+// At the slow clock (see profile.h) the ADC clock is F_CPU_SLOW/2 = 62.5kHz, so fewer conversions cover the same 1ms.
+
+#define ADC_SETTLE_CONVERSIONS_SLOW 5
+
 // Enables ADC and sets to read the internal 1.1V bandgap voltage against Vcc scale
 
 void adc_on(void) {
     
+    power_adc_enable();             // Powered down with PRR whenever it is off (see adc_off())
+    
     // Select ADC inputs
     // bit    76543210 
     // REFS = 00       = Vcc used as Vref
@@ -38,8 +60,22 @@ void adc_on(void) {
     kHz and 200 kHz to get maximum resolution.
     */  
                 
+    uint8_t settle = ADC_SETTLE_CONVERSIONS;
+    
+#ifdef DYNAMIC_CLOCK
+    if (CLKPR == CLOCK_SLOW_CLKPS) {
+        
+        // Running slow, so prescaller /2 gives an ADC clock of 125kHz/2 = 62.5kHz
+        ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS0);
+        
+        settle = ADC_SETTLE_CONVERSIONS_SLOW;
+        
+    } else
+#endif
+    
     // Enable ADC, set prescaller to /8 which will give a ADC clock of 1mHz/8 = 125kHz    
-    ADCSRA = _BV(ADEN) | _BV(ADPS1) | _BV(ADPS0);
+    // Also enable conversion complete interrupt so we can sleep during conversions
+    ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS1) | _BV(ADPS0);
 
     // Enable ADC, set prescaller to /2 which will give a ADC clock of 128khz/2 = 64kHz    
     //ADCSRA = _BV(ADEN);
@@ -50,18 +86,14 @@ void adc_on(void) {
         measurements are stable. Conversions starting before this may not be reliable. The ADC must
         be enabled during the settling time.
     */
-        
-    _delay_ms(1);
                 
     /*
         The first conversion after switching voltage source may be inaccurate, and the user is advised to discard this result.
     */
     
-    ADCSRA |= _BV(ADSC);                // Start a conversion
-
-
-    while( ADCSRA & _BV( ADSC) ) ;      // Wait for 1st conversion to be ready...
-                                        //..and ignore the result        
+    for( uint8_t c = settle; c ; c-- ) {
+        readADC();                      // Sleep through conversions until settled...
+    }                                   //..and ignore the results        
     
 }
 
@@ -75,6 +107,8 @@ void adc_on(void) {
 void adc_off(void) {
     
    ADCSRA &= ~_BV( ADEN );         // Disable ADC to save power
+   
+   power_adc_disable();            // Has to be disabled first, then we can stop its clock too
     
 }        
 
@@ -82,10 +116,16 @@ void adc_off(void) {
 uint16_t readADC(void) {
     
         
-    ADCSRA |= _BV(ADSC);                // Start a conversion
+    ADCSRA |= _BV(ADSC);                // Start a conversion (entering ADC Noise Reduction mode would too, but this way we know)
 
+    set_sleep_mode( SLEEP_MODE_ADC );
+    sleep_enable();
 
-    while( ADCSRA & _BV( ADSC) ) ;      // Wait for conversion to be ready...
+    while( ADCSRA & _BV( ADSC) ) {      // Wait for conversion to be ready...
+        sei();                          // ...asleep. Some other interrupt might wake us first, so keep checking.
+        sleep_cpu();
+        cli();
+    }
         
     /*
         After the conversion is complete (ADIF is high), the conversion result can be found in the ADC
@@ -102,3 +142,20 @@ uint16_t readADC(void) {
     return adc;
                     
 }
+
+
+uint16_t sampleADC(void) {
+    
+    timing_begin( TIMING_ADC );
+    
+    adc_on();
+    
+    uint16_t adc = readADC();
+    
+    adc_off();
+    
+    timing_end( TIMING_ADC );
+    
+    return adc;
+    
+}
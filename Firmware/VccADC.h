@@ -37,26 +37,47 @@ void adc_off(void);
 
 #define ADC_DELAY_US 125 
 
+// Does one conversion in ADC Noise Reduction sleep. ADC must be on.
+
 uint16_t readADC(void);
 
-// This macro gives you the current Vcc voltage for a given ADC value returned from readADC()
+// Turns the ADC on, takes one reading, and turns it back off. 
+// Use this for occasional samples so the ADC is not burning power in between.
+
+uint16_t sampleADC(void);
+
+// All voltages here are in integer millivolts so that nothing drags the floating point library into
+// the image. The bandgap is read against Vcc, so the ADC value goes *up* as Vcc goes *down*.
+
+// Vcc   =  (1.1v * 1023) / ADC
 
-#define ADC2VCC(a) ( (1.1*1023) / a )
+#define BANDGAP_MV      1100UL                  // Nominal internal bandgap reference
+#define ADC_FULL_SCALE  1023UL
 
-// This macro will give you the value returned from the ADC for a Vcc voltage of V
-// Nice to have in a macro because for fixed voltages, you can precompute 
-// rather than doing an expensive 16 bit multiply and divide at runtime. 
+// This macro gives you the current Vcc in millivolts for a given ADC value returned from readADC()
+// Note this does a 32 bit divide at runtime, so only use it when you really need millivolts
 
-// Vcc   =  (1.1v * 1024) / ADC
+#define ADC2VCC_MV(a) ( (uint16_t) ( (BANDGAP_MV*ADC_FULL_SCALE) / (a) ) )
 
-#define VCC2ADC(v) ((uint16_t) ((1.1*1023.0)/v))
+// Same thing in fixed point tenths of a volt (so 30 = 3.0v). Fits in a 16 bit divide, so much cheaper
+// at runtime. Good enough for blinking out the voltage. 
 
-// This macro tests if the current Vcc is currently below the specified voltage
+#define ADC2VCC_TENTHS(a) ( (uint8_t) ( (uint16_t) ( (BANDGAP_MV*ADC_FULL_SCALE) / 100UL ) / (uint16_t) (a) ) )
+
+// This macro will give you the value returned from the ADC for a Vcc voltage of MV millivolts
+// Nice to have in a macro because for fixed voltages, the compiler precomputes the
+// count rather than doing an expensive 32 bit multiply and divide at runtime. Rounds to nearest count.
+
+#define VCC2ADC(mv) ( (uint16_t) ( ( (BANDGAP_MV*ADC_FULL_SCALE) + ((mv)/2) ) / (mv) ) )
+
+// This macro tests if the current Vcc is currently below the specified voltage in millivolts
 // Note that the `<` is reversed becuase larger values from the ADC corespond to smaller
 // Vcc voltages when measuring the internal bandgap like we do here. 
 
 
-// Note that this is a macro so the floating point math in VCC2ADC can be evaluated statically
-// when V is const, which it should be. 
+// Note that this is a macro so the math in VCC2ADC can be evaluated statically
+// when MV is const, which it should be. Then each check is just a 16 bit compare. 
+
+#define VCC_LESS_THAN_ADC(a,mv) ((a)>VCC2ADC(mv))      // returns true if the Vcc for ADC reading a is less than MV
 
-#define VCC_LESS_THAN(v) (readADC()>VCC2ADC(v))      // returns true if the Measured Vcc is than V
+#define VCC_LESS_THAN(mv) VCC_LESS_THAN_ADC(sampleADC(),mv)      // returns true if the Measured Vcc is than MV (takes a fresh sample)
@@ -0,0 +1,315 @@
+/***
+
+Receive side of the One-touch Programming Jig protocol (version 2)
+
+Everything is sent as the time between the starts of ~1ms dips in Vcc. The unit of time T
+is picked by the jig to be a bit longer than our cap takes to recover from a dip, and we learn
+it from the preamble, so we never need to know it ahead of time. Each interval is...
+
+    T + k*T/4
+
+...where k is the symbol. A copy of a frame is...
+
+    preamble        at least PROG_PREAMBLE_LOCK+1 dips with k=0, we lock onto T from these
+    delimiter       k=4
+    7 bytes         each is 4 symbols of 2 bits (k=0-3, MSB pair first) followed by a
+                    parity symbol (k=0 for an even number of 1 bits, k=2 for odd)
+
+The 7 bytes are the same as version 1...
+
+    channel high byte
+    channel low byte
+    deemphasis
+    band
+    spacing
+    CRC-16 high byte       (_crc16_update() over the 5 bytes above, starting at 0)
+    CRC-16 low byte
+
+There is no way to ask the jig to resend, so the jig sends each frame several times back to back.
+We keep every byte that passed parity, so a bad bit in one copy only needs that byte from a later copy.
+Frames have at least 50ms idle between them.
+
+This code is processor specific so may not work on other chips besides ATTINY25/45/85.
+
+This code assumes default clock speed of 1MHz.
+
+***/
+
+#include <avr/io.h>
+#include <util/crc16.h>
+#include <avr/power.h>
+
+#include "profile.h"
+
+#include "VccADC.h"
+#include "VccProg.h"
+
+// Everything is timed by Timer0 free running off the /256 prescaler, so a tick is 256us.
+// That gives us a few ticks between symbols at the shortest T the jig will use (4ms) and
+// still fits the longest (20ms) delimiter in 8 bits.
+
+#define PROG_TICKS(us)  ( ( (us) * (F_CPU/1000000UL) ) / 256UL )
+
+#define PROG_QUIET              PROG_TICKS(50000)       // No dips for this long means the line is between frames. Also how long
+                                                        // we will wait for the next dip inside a frame before giving up on this copy.
+
+#define PROG_IDLE_WINDOW        PROG_TICKS(45000)       // Longer than the longest interval, so we always see some time between dips
+
+#define PROG_TIMEOUT            (0xff)                  // Returned by waitDip(), must be bigger than any timeout above
+
+#define PROG_PREAMBLE_LOCK      (4)                     // Need to see this many intervals in a row that agree to lock onto T
+
+#define PROG_SYMBOL_ERROR       (0xff)                  // Interval too short to be any symbol
+#define PROG_SYMBOL_DELIMITER   (4)
+#define PROG_SYMBOLS_PER_BYTE   (4)
+
+#define PROG_FRAME_DATA         (5)                     // Data bytes in a frame, not counting the CRC
+#define PROG_FRAME_SIZE         (PROG_FRAME_DATA+2)
+
+#define PROG_FRAME_ALL          ( (1<<PROG_FRAME_SIZE) - 1 )   // One bit per byte we have a good copy of
+
+// Dip thresholds are relative to the Vcc we see when the line is idle, so it does not matter exactly
+// how high the jig drives. A dip is when Vcc falls below about 89% of idle, and it is over when Vcc
+// gets back above about 94%. The gap is hysteresis so a slow recovery does not look like extra dips.
+// Remember bigger ADC values mean lower Vcc.
+
+static uint16_t prog_dipped;
+static uint16_t prog_recovered;
+
+static uint8_t prog_t;                  // T in ticks, learned from the preamble
+
+// Do a conversion without sleeping. ADC Noise Reduction mode would stop Timer0, and we are on
+// jig power anyway so no need to save power here.
+
+static uint16_t sampleNow(void) {
+
+    ADCSRA |= _BV(ADSC);                // Start a conversion
+
+    while( ADCSRA & _BV( ADSC) ) ;      // Wait for conversion to be ready...
+
+    return ADC;
+
+}
+
+// Zero the tick count, including the prescaler so the first tick is a full one
+
+static void restartTicks(void) {
+
+    GTCCR = _BV(PSR0);
+    TCNT0 = 0;
+
+}
+
+// Set the dip thresholds from the highest Vcc we see over PROG_IDLE_WINDOW
+
+static void measureIdle(void) {
+
+    uint16_t idle = 0xffff;
+
+    restartTicks();
+
+    while (TCNT0 < PROG_IDLE_WINDOW) {
+
+        uint16_t s = sampleNow();
+
+        if (s < idle) idle = s;
+
+    }
+
+    prog_dipped    = idle + (idle/8);
+    prog_recovered = idle + (idle/16);
+
+}
+
+// Wait for Vcc to recover from any dip in progress, and then for the start of the next dip.
+// Returns the tick count when the dip started, or PROG_TIMEOUT if the tick count gets to _until_ first.
+
+static uint8_t waitDip( uint8_t until ) {
+
+    while ( sampleNow() > prog_recovered ) {        // Still in previous dip
+        if (TCNT0 >= until) return PROG_TIMEOUT;
+    }
+
+    while ( sampleNow() < prog_dipped ) {           // Wait for next dip
+        if (TCNT0 >= until) return PROG_TIMEOUT;
+    }
+
+    return TCNT0;
+
+}
+
+// Time from the last dip to the next one, or PROG_TIMEOUT
+
+static uint8_t nextInterval(void) {
+
+    uint8_t d = waitDip( PROG_QUIET );
+
+    restartTicks();
+
+    return d;
+
+}
+
+// Turn an interval into a symbol (k) by rounding to the nearest T/4.
+// Returns PROG_SYMBOL_ERROR if we timed out or it was too soon to be a symbol.
+
+static uint8_t symbolOf( uint8_t d ) {
+
+    if (d == PROG_TIMEOUT || d < prog_t - (prog_t/8) ) return PROG_SYMBOL_ERROR;
+
+    // k = (d-T)/(T/4), rounded. Rearranged to stay positive and do one 16 bit divide.
+
+    return ( ((uint16_t) d * 4 ) + (prog_t/2) - ((uint16_t) prog_t * 4) ) / prog_t;
+
+}
+
+static uint8_t nextSymbol(void) {
+
+    return symbolOf( nextInterval() );
+
+}
+
+// Wait for a preamble and lock onto T. Returns once we have seen the delimiter.
+
+static void waitPreamble(void) {
+
+    uint8_t count = 0;
+
+    prog_t = 0;             // Not locked yet
+
+    do {
+        restartTicks();
+    } while (waitDip( PROG_QUIET ) == PROG_TIMEOUT);
+
+    restartTicks();
+
+    while (1) {
+
+        uint8_t d = nextInterval();
+
+        if (count >= PROG_PREAMBLE_LOCK) {
+
+            // Locked, so anything that is not another preamble interval should be the delimiter
+
+            uint8_t k = symbolOf( d );
+
+            if (k == PROG_SYMBOL_DELIMITER) return;
+
+            if (k != 0) {
+                count = 0;          // Not part of a preamble after all, start over
+                prog_t = d;
+            }
+
+        } else if (d != PROG_TIMEOUT && d > prog_t - (prog_t/8) && d < prog_t + (prog_t/8) ) {
+
+            count++;            // Agrees with the last one
+
+        } else {
+
+            count = 0;          // Start over with this one as our guess for T
+
+            prog_t = d;
+
+        }
+
+    }
+
+}
+
+uint8_t vccprog_receive( vccprog_frame *frame ) {
+
+    uint8_t buffer[PROG_FRAME_SIZE];
+    uint8_t good = 0;                       // Bytes we have a copy of that passed parity
+
+    power_timer0_enable();                  // Powered down unless in use, see main.c
+
+    TIMSK &= ~_BV(OCIE0A);                  // No interrupts, we just read TCNT0
+    TCCR0A = 0;                             // Normal mode
+    TCCR0B = _BV(CS02);                     // clk/256
+
+    // Wait for a quiet line. Must be between frames, so the next thing is a preamble
+
+    do {
+        measureIdle();
+        restartTicks();
+    } while (waitDip( PROG_QUIET ) != PROG_TIMEOUT);
+
+    uint8_t ok = 0;
+
+    while (!ok) {
+
+        waitPreamble();
+
+        for( uint8_t i=0; i < PROG_FRAME_SIZE; i++ ) {
+
+            uint8_t b = 0;
+            uint8_t parity = 0;
+
+            for( uint8_t s=PROG_SYMBOLS_PER_BYTE; s ; s-- ) {
+
+                uint8_t k = nextSymbol();
+
+                if (k > 3) goto nextcopy;                   // Lost this copy, try again with the next one
+
+                b = (b << 2) | k;
+
+                parity ^= k ^ (k>>1);                       // Low bit is the parity of the bits so far
+
+            }
+
+            uint8_t p = nextSymbol();
+
+            if (p > 3) goto nextcopy;
+
+            if ( p == ((parity & 1) << 1) && !(good & (1<<i)) ) {
+
+                buffer[i] = b;
+                good |= (1<<i);
+
+            }
+
+        }
+
+nextcopy:
+
+        if (good == PROG_FRAME_ALL) {
+
+            uint16_t crc = 0x0000;
+
+            for( uint8_t i=0; i < PROG_FRAME_DATA; i++ ) {
+                crc = _crc16_update(crc, buffer[i] );
+            }
+
+            if ( (crc >> 8) == buffer[PROG_FRAME_DATA] && (crc & 0xff) == buffer[PROG_FRAME_DATA+1] ) {
+
+                ok = 1;
+
+            } else {
+
+                good = 0;           // Bytes must have come from different frames, start over
+
+            }
+
+        }
+
+    }
+
+    // Swallow any copies still coming so they do not look like a new frame
+
+    do {
+        restartTicks();
+    } while (waitDip( PROG_QUIET ) != PROG_TIMEOUT);
+
+    TCCR0B = 0;                             // Timer0 off
+    power_timer0_disable();
+
+    frame->channel    = (buffer[0] << 8) | buffer[1];
+    frame->deemphasis = buffer[2];
+    frame->band       = buffer[3];
+    frame->spacing    = buffer[4];
+
+    // Same limits as eeprom.py. CHAN is 10 bits in register 03h.
+
+    return frame->channel <= 0x03ff && frame->band <= 2 && frame->deemphasis <= 1 && frame->spacing <= 2;
+
+}
@@ -0,0 +1,44 @@
+/***
+
+Receive side of the One-touch Programming Jig protocol (version 2)
+
+The jig powers the TPR through the battery clips at about 5V and sends data by briefly
+pulling Vcc down. We watch Vcc with the bandgap ADC (see VccADC.h) and decode the dips.
+
+See VccProg.c for the protocol description.
+
+This code assumes default clock speed of 1MHz.
+
+***/
+
+#if !defined( F_CPU )
+    #error F_CPU must be definded before this header
+#endif
+
+#include <inttypes.h>
+
+// Batteries can not get this high (even 2x lithium AA is only 3.6V), so if we see this at power up
+// then we must be on the jig
+
+#define VCCPROG_MV (4500)
+
+// Which version of the protocol we speak. We blink this many times when we go into programming mode 
+// so you can tell which to select on the jig. Version 1 is not supported anymore, so a jig running the
+// old sketch (version 1 only) can not program this firmware. Load the current sketch on it.
+
+#define VCCPROG_VERSION (2)
+
+// One frame from the jig. Same fields as the param block in main.c.
+
+typedef struct {
+    uint16_t channel;
+    uint8_t  band;
+    uint8_t  deemphasis;
+    uint8_t  spacing;
+} vccprog_frame;
+
+// Waits for the next frame from the jig and decodes it into *frame. ADC must be on.
+// Returns true if a frame with good framing, CRC, and in range values was received.
+// Uses Timer0 for timing, so do not use idleFor() while this is running.
+
+uint8_t vccprog_receive( vccprog_frame *frame );
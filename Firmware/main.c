@@ -44,7 +44,8 @@
  *     them from the same shadow storage in AVR RAM.
  *
  *   - To change a register, we will modify the shadow registers in place
- *     and then write back the entire bank of 6.
+ *     (which marks them dirty) and then write back from 0x2 up to the
+ *     highest dirty register.
  *
  *   - The Tiny25 has limited resources, to preserve these, the shadow
  *     registers are not laid out from 0 in AVR memory, but rather from 0xA
@@ -135,13 +136,17 @@
 #include <avr/eeprom.h>
 #include <util/crc16.h>
 #include <avr/wdt.h>
+#include <avr/power.h>
+#include <string.h>
 
-#define	F_CPU	1000000UL
+#include "profile.h"
 #include <util/delay.h>
 
 
 #include "USI_TWI_Master.h"
 #include "VccADC.h"
+#include "VccProg.h"
+#include "TimingBudget.h"
 
 #define FMIC_ADDRESS        (0b0010000)                // Hardcoded for this chip, "a seven bit device address equal to 0010000"
 
@@ -153,19 +158,35 @@
 #define BUTTON_INPUT_BIT    PB3
 #define BUTTON_PCINT_BIT    PCINT3
 #define LONG_PRESS_MS       (2000)      // Hold down button this long for a long press
+#define VERYLONG_PRESS_MS   (4000)      // Hold down button this long for a very long press (factory reset)
+#define BUTTON_STUCK_MS     (10000)     // Stop timing (and flashing) if the button is held this long
 #define BUTTON_DEBOUNCE_MS  (50)        // How long to debounce button edges
 
+#define BUTTON_TICK         HOWLONG_125MS   // WDT period used to time button presses
+#define BUTTON_TICK_MS      (125)
 
-#define LOW_BATTERY_VOLTAGE_COLD (2.1)          // We need to see this at power up to start operation. 
-#define LOW_BATTERY_VOLTAGE_WARM (1.80)         // If we get this low, we are not working anymore so user accidentally 
+#define LONG_PRESS_TICKS        (LONG_PRESS_MS / BUTTON_TICK_MS)
+#define VERYLONG_PRESS_TICKS    (VERYLONG_PRESS_MS / BUTTON_TICK_MS)
+#define BUTTON_STUCK_TICKS      (BUTTON_STUCK_MS / BUTTON_TICK_MS)         // Must fit in uint8_t
+
+
+#define LOW_BATTERY_MV_COLD (2100)             // We need to see this at power up to start operation. 
+#define LOW_BATTERY_MV_WARM (1800)             // If we get this low, we are not working anymore so user accidentally 
                                                 // left power on. We should down to avoid battery blistering
                                              
-#define LOW_BATTERY_VOLTAGE_WARM_COUNT  10      // We need to see this many consecutive low battery voltage readings before shutting down
+#define LOW_BATTERY_WARM_COUNT  10              // We need to see this many consecutive low battery voltage readings before shutting down
                                                 // this prevents us from shutting down based on seeing one sample that might have happened 
                                                 // right when the amp was pulling a spike of current. 
                                                 
+// How often we check the battery while playing depends on how close we are to LOW_BATTERY_MV_WARM. 
+// Batteries go down over hours, so there is no point waking up every second when they are nowhere near empty.
+
+#define BATTERY_CHECK_FAST_BELOW_MV (2100)     // Below this check every second, so the low count debounce works like it always did
+#define BATTERY_CHECK_SLOW_ABOVE_MV (2400)     // Above this only check every 8 seconds, in between every 4
                                                 
-// TODO: Empirically figure out optimal values for low battery voltages
+// TODO: Empirically figure out optimal values for low battery voltages (all in millivolts, see VccADC.h)
+
+#define PROGRAMMING_VOLUME (0x0f)     // The jig does not send a volume, so use max (0 dBFS) like eeprom.py does by default
 
 #define LED_COUNT (2)       // How many initial breaths should we display? Resets on startup and after each button press. Each breath currently about 2 secs.
 
@@ -177,10 +198,15 @@
 #define DIAGNOSTIC_BLINK_LOWBATTERY    2            // Battery too low for operation. 
 
 #define DIAGNOSTIC_BLINK_TIMEOUT_S   120            // Show diagnostic blink at least this long before going to sleep
+
                                                     // Give user time to see it, but don't go too long because we will
 
                                                     // make crusty batteries. Must fit in unit8_t.
 
+#define RESUME_MV       (2700)          // After a low battery shutdown, start playing again if we see this (fresh batteries)
+#define RESUME_COUNT    (2)             // ...this many checks in a row
+#define RESUME_CHECK    HOWLONG_2S      // ...checking this often
+
 #define SBI(port,bit) (port|=_BV(bit))
 #define CBI(port,bit) (port&=~_BV(bit))
 #define TBI(port,bit) (port&_BV(bit))
@@ -200,7 +226,7 @@ typedef enum {
 	REGISTER_0B =  2,
     
 
-    // These not used in current implementation. 
+    // RDS blocks A-D. Only used by the RDS build, which only looks at the PI code in block A. 
 	REGISTER_0C =  4,
 	REGISTER_0D =  6,
 	REGISTER_0E =  8,
@@ -223,25 +249,144 @@ typedef enum {
 #define REG_02_DEFAULT ( _BV( REG_02_DMUTE_BIT) |  _BV(REG_02_MONO_BIT) | _BV(REG_02_ENABLE_BIT) | _BV(REG_02_SEEKUP_BIT) )    // Used mostly when setting and clearing seek bit
 
 
+#define REG_01_FIRMWARE_MASK 0x003f   // Firmware version. Reads 0 before powerup, the real version after.
+
+#define REG_04_RDS_BIT      12          // RDS enable
 #define REG_04_DE_BIT       11          // Deemphasis
 
+#define REG_05_VOLUME_MASK  0x000f      // Volume. 0 is mute, then about 2dB a step up to 15.
+
+#define REG_0A_RDSR_BIT     15          // RDS Ready. A new group is in 0x0C-0x0F. 
+#define REG_0A_STC_BIT      14          // Seek/Tune Complete. Set when done, cleared by clearing SEEK or TUNE.
+#define REG_0A_SFBL_BIT     13          // Seek Fail/Band Limit
+#define REG_0A_RSSI_MASK    0x00ff      // RSSI in dBuV, 0-75
+
+#define REG_0B_READCHAN_MASK 0x03ff     // Current channel
+
 #define REG_07_XOSCEN       15          // Enable crystal oscillator
 #define REG_07_AHIZEN       14          // Audio high-Z enable
 
 
-#define EEPROM_BAND		    ((const uint8_t *)0)
-#define EEPROM_DEEMPHASIS	((const uint8_t *)1)
-#define EEPROM_SPACING		((const uint8_t *)2)
-#define EEPROM_CHANNEL		((const uint16_t *)3)
-#define EEPROM_VOLUME		((const uint8_t *)5)
-#define	EEPROM_CRC16		((const uint16_t *)14)      // Each block has an independent CRC-16
+// Layout of a parameter block in EEPROM. Must match with other tools that make EEPROM images.
+// Multi-byte values are little endian, same as AVR.
+
+typedef struct {
+    uint8_t  band;
+    uint8_t  deemphasis;
+    uint8_t  spacing;
+    uint16_t channel;
+    uint8_t  volume;
+    uint8_t  seek_rssi;             // Seek thresholds, see si4702_enable(). Only used if PARAM_FLAG_SEEK_SET. 
+    uint8_t  seek_snr;
+    uint8_t  seek_impulse;
+    uint8_t  flags;                 // PARAM_FLAG_* bits
+    uint8_t  generation;            // One more than the other bank each time we save, see save_params()
+    uint8_t  reserved[3];
+    uint16_t crc16;                 // Each block has an independent CRC-16
+} __attribute__((packed)) param_block;
+
+#define PARAM_FLAG_STRONG_ONLY  0           // Seek only stops on strong, clean stations (see SEEK_STRONG_*)
+#define PARAM_FLAG_SEEK_SET     1           // seek_rssi, seek_snr, and seek_impulse are set, otherwise use the defaults
 
 #define EEPROM_PARAM_BLOCK_SIZE	(16)
 
+// Working params are read into here once at boot by load_params() and used from here on
+// so we don't keep going back to EEPROM. 
+
+static param_block params;
+
+// Locale settings. A locale build (see profile.h) fixes these at compile time so they fold to constants,
+// otherwise they come from the param block.
+
+#ifdef PROFILE_BAND
+    #define LOCALE_BAND         (PROFILE_BAND)
+    #define LOCALE_SPACING      (PROFILE_SPACING)
+    #define LOCALE_DEEMPHASIS   (PROFILE_DEEMPHASIS)
+#else
+    #define LOCALE_BAND         (params.band)
+    #define LOCALE_SPACING      (params.spacing)
+    #define LOCALE_DEEMPHASIS   (params.deemphasis)
+#endif
+
 // Starting address of parameter blocks in EEPROM. Can't overlap and must match with other tools that make EEPROM images
+// The working params are in two banks. Saves go to the bank not in use, and boot uses the newest one with a 
+// good CRC, so losing power part way through a save just leaves the old bank in charge. Bank B goes after the 
+// manufacturing record (0x20-0x52). eeprom.py writes bank A with generation 0 and erases bank B.
 
-#define	EEPROM_WORKING		((const uint8_t *) 0)
+#define	EEPROM_BANK_A		((const uint8_t *) 0)
 #define EEPROM_FACTORY		((const uint8_t *)16)
+#define EEPROM_BANK_B		((const uint8_t *)0x60)
+
+// Channel journal. Saved channels are appended here as small records rather than rewriting the 
+// channel and CRC in the working params each time. Goes after bank B. 
+// Must match with the EEPROM tools. 
+// Only 4 slots, since 8 (32 bytes) don't fit between bank B and the end of the ATTINY25 EEPROM at 0x7f.
+// Each slot gets every 4th save, so at 100,000 writes per byte that is still about 400,000 saves.
+
+#define EEPROM_JOURNAL              ((const uint8_t *)0x70)
+#define EEPROM_JOURNAL_SLOTS        (4)
+#define EEPROM_JOURNAL_RECORD_SIZE  (4)
+
+// Each journal record is...
+//    0 - Sequence number, one more than the previous record (wraps)
+//    1 - Channel low byte
+//    2 - Channel high byte
+//    3 - CRC-8 (CCITT) of bytes 0-2. Erased EEPROM (0xff's) never passes. 
+
+#ifdef TELEMETRY
+
+// Field telemetry counters, so units back from the field can tell us where the battery went.
+// Only built with `make TELEMETRY=counters`. Fills the gap between the manufacturing record and bank B,
+// which eeprom.py never writes, so reprogramming the station keeps the counts. Must match dump_eeprom.py.
+// Counts stick at their max instead of wrapping.
+// Written rarely so it doesn't add wear next to the params we depend on: every TELEMETRY_SAVE_MINUTES of play
+// and at low battery shutdown, and only the bytes that changed. At one write an hour the busiest bytes (the low
+// byte of play_minutes and the CRC) last about 100,000 hours of play. Whatever happened since the last write is
+// lost when the knob turns us off, so sessions shorter than that are not counted at all.
+// Play time adds up the nominal sleep of each pass through run(), so it is only approximate (see run()).
+
+#define EEPROM_TELEMETRY            ((const uint8_t *)0x53)
+#define TELEMETRY_SAVE_MINUTES      (60)
+
+typedef struct {
+    uint16_t power_ons;             // Times we got as far as run(), not counting the programming jig
+    uint32_t play_minutes;          // From the nominal sleep of each pass through the run() loop
+    uint16_t seeks;                 // Short presses
+    uint8_t  saves;                 // Long presses
+    uint8_t  low_batteries;         // Times in lowBatteryShutdown()
+    uint16_t vcc_adc_max;           // Biggest ADC reading while playing, which is the lowest Vcc (see VccADC.h)
+    uint8_t  crc8;                  // CRC-8 (CCITT) of the rest. Erased EEPROM never passes, so we start from 0.
+} __attribute__((packed)) telemetry_block;
+
+#endif
+
+#ifdef SCAN_CACHE
+
+// Station scan cache. A list of the stations found by a muted scan of the whole band, so a short press
+// can tune straight to the next one instead of seeking. Only fits in the 256 byte EEPROM of the ATTINY45,
+// so only built with `make SCAN=cache`. Channels are in the order found, which is bottom of the band up.   
+//    0      - Count of channels, erased EEPROM (0xff) means no scan yet. 0 (nothing found, maybe the antenna
+//             was not out) is never trusted, so we scan again next boot.
+//    1-48   - Channels, 2 bytes each low byte first
+//    49     - CRC-8 (CCITT) of the band, spacing, and deemphasis we tune with (LOCALE_*), then the count and all of
+//             the channel slots. So a cache scanned with different settings (an ISP reprogram that did not
+//             erase it) just fails the check and we scan again.
+
+#define EEPROM_SCAN_CACHE           ((const uint8_t *)0x80)
+#define SCAN_CACHE_SLOTS            (24)
+#define SCAN_CACHE_CHANNELS         (EEPROM_SCAN_CACHE + 1)
+#define SCAN_CACHE_CRC8             (SCAN_CACHE_CHANNELS + (SCAN_CACHE_SLOTS * 2))
+
+#if E2END < 0xff
+    #error SCAN_CACHE needs the 256 byte EEPROM of an ATTINY45 or bigger
+#endif
+
+#endif
+
+#define JOURNAL_SEQ         0
+#define JOURNAL_CHANNEL_LO  1
+#define JOURNAL_CHANNEL_HI  2
+#define JOURNAL_CRC8        3
 
 
 static inline void LED_on(void) {
@@ -263,16 +408,32 @@ static uint16_t get_shadow_reg(si4702_register reg)
 	return (shadow[reg] << 8) | (shadow[reg + 1]);
 }
 
-// Making this a macro saves 20 bytes of precious flash
+// Dirty tracking for the writable registers 0x02 thru 0x09, one bit each (bit 0 = 0x02).
+// A bit is set when the shadow has been changed but not yet written to the chip by si4702_flush(). 
+
+#define SHADOW_DIRTY_BIT(reg)   _BV( ((reg) - REGISTER_02) / 2 )
+
+#define SHADOW_WRITABLE_UPTO_07 (SHADOW_DIRTY_BIT(REGISTER_07) * 2 - 1)      // 0x02 - 0x07, only during init
+#define SHADOW_WRITABLE_UPTO_06 (SHADOW_DIRTY_BIT(REGISTER_06) * 2 - 1)      // 0x02 - 0x06, after powerup
 
-#define set_shadow_reg(reg,value) shadow[reg] = (value) >> 8; shadow[reg + 1] = (value) & 0xff
+static uint8_t shadow_dirty;        
 
-// Real code for above macro for clarity (but unused here to save space)
+// Which registers si4702_flush() is allowed to write. REGISTER_07 drops out of here once the chip is
+// enabled since it has reserved bits that we should not overwrite after powerup (see si4702_init()).
+// This way nobody has to remember that rule when adding a write.
 
-static inline void set_shadow_reg_non_macro(si4702_register reg, uint16_t value)
+static uint8_t shadow_writable;
+
+// Change a register in the shadow. Only marks it dirty if the value actually changed
+// so we don't send words the chip already has. 
+
+static void set_shadow_reg(si4702_register reg, uint16_t value)
 {
-	shadow[reg] = value >> 8;
-	shadow[reg + 1] = value & 0xff;
+    if ( get_shadow_reg(reg) != value ) {
+    	shadow[reg] = value >> 8;
+    	shadow[reg + 1] = value & 0xff;
+        shadow_dirty |= SHADOW_DIRTY_BIT(reg);
+    }        
 }
 
 // Read registers 0x0a and 0x0b from FM_IC.
@@ -282,104 +443,785 @@ static inline void set_shadow_reg_non_macro(si4702_register reg, uint16_t value)
 
 static void si4702_read_registers_upto_0B(void)
 {
-    USI_TWI_Read_Data( FMIC_ADDRESS , shadow , REGISTER_0B - REGISTER_0A + 2 );      // Total of 10 registers,  each 2 bytes
+    timing_begin( TIMING_TWI );
+    USI_TWI_Read_Data( FMIC_ADDRESS , shadow , REGISTER_0B - REGISTER_0A + 2 );      // Total of 2 registers,  each 2 bytes
+    timing_end( TIMING_TWI );
+}
+
+// Read registers 0x0a thru 0x01 from FM_IC (wrapping at 0x0f). 
+// Thanks to the shadow layout these all land contiguously at the bottom of the buffer, and
+// 0x01 is the last one we can read without clobbering the write shadows that start at 0x02.
+// We need 0x01 because the firmware version field in there reads 0 until the chip has powered up.
+
+static void si4702_read_registers_upto_01(void)
+{
+    timing_begin( TIMING_TWI );
+    USI_TWI_Read_Data( FMIC_ADDRESS , shadow , REGISTER_01 - REGISTER_0A + 2 );      // Total of 8 registers,  each 2 bytes
+    timing_end( TIMING_TWI );
+}
+
+#ifdef RDS_PI
+
+// Read registers 0x0a thru 0x0f from FM_IC, which is the status plus all four RDS blocks in one burst.
+
+static void si4702_read_registers_upto_0F(void)
+{
+    timing_begin( TIMING_TWI );
+    USI_TWI_Read_Data( FMIC_ADDRESS , shadow , REGISTER_0F - REGISTER_0A + 2 );      // Total of 6 registers,  each 2 bytes
+    timing_end( TIMING_TWI );
+}
+
+#endif
+
+/*
+ * Write all the dirty registers from the shadow array in one burst.
+ */
+
+// Writes on this chip always start at 0x02, so the shortest burst that gets every change to the chip
+// is 0x02 up to and including the highest dirty register. Does nothing if nothing changed.
+// Call this between changes that have to happen as separate writes (the chip is picky about order).
+
+static void si4702_flush(void)
+{
+    uint8_t dirty = shadow_dirty & shadow_writable;
+    
+    if (dirty) {
+    
+        uint8_t count = 0;
+    
+        while (dirty) {             // Each register is 2 bytes wide
+            dirty >>= 1;
+            count += 2;
+        }
+            
+        timing_begin( TIMING_TWI );
+        USI_TWI_Write_Data( FMIC_ADDRESS ,  &(shadow[REGISTER_02]) , count );
+        timing_end( TIMING_TWI );
+        
+    }
+    
+    shadow_dirty = 0;
+    
+}
+
+
+
+/*
+ * Seek thresholds - see Appendix of SiLabs AN230
+ * These are only the defaults for param blocks without PARAM_FLAG_SEEK_SET, which is every image from
+ * before the thresholds were in there and anything from the programming jig. They are what the firmware
+ * always used, so those units seek the same as they always did. The original code never set SEEKTH, so
+ * the chip had its reset value of 0. eeprom.py sets the flag and the per locale AN284 recommendations.
+ */
+#define	SEEK_RSSI_THRESHOLD	(0)
+#define	SEEK_SNR_THRESHOLD	(2)
+#define SEEK_IMPULSE_THRESHOLD	(4)
+
+/*
+ * "Strong stations only" profile - the AN284 "good quality stations only" SNR and impulse settings
+ * with the recommended RSSI threshold. These are floors, so a stricter setting in the param block still wins.
+ * Fewer stops means fewer presses (and seeks) to get to a station worth listening to.
+ */
+#define	SEEK_STRONG_RSSI_THRESHOLD	(25)
+#define	SEEK_STRONG_SNR_THRESHOLD	(7)
+#define SEEK_STRONG_IMPULSE_THRESHOLD	(15)
+
+
+// EEPROM write queue. Each byte takes about 3.4ms to program, so rather than spin through that we hand
+// a block to the EE_RDY interrupt, which starts the next byte every time the last one finishes. The main thread
+// only enables interrupts while asleep, so the writes happen while we sleep through something else (like the
+// LED confirm blink). Bytes go out in order, so anything that puts its CRC last is still safe if power goes
+// part way through.
+//
+// EE_RDY can not wake us from power down, so ledStep() uses idle sleep while a write is still queued and 
+// sleepFor() waits for the queue to drain first. Anything that reads back what was queued must eepromFlush() first.
+//
+// The queue is not the only writer. Params, the factory block, the scan cache, telemetry, and the timing record
+// all use the blocking eeprom_*() calls, and those must eepromFlush() first too. Otherwise they could go out
+// ahead of a queued journal record (or land in the middle of one), and a brownout would leave the journal
+// older than the params.
+
+#define EEPROM_QUEUE_SIZE   (4)                 // One journal record
+
+static uint8_t eepromQueue[EEPROM_QUEUE_SIZE];
+static uint16_t eepromQueueAddr;                // Where eepromQueue[0] goes
+static uint8_t eepromQueueLen;
+static volatile uint8_t eepromQueueNext;        // Next byte to start
+
+ISR( EE_RDY_vect ) {
+    
+    if (eepromQueueNext < eepromQueueLen) {
+        
+        EEAR = eepromQueueAddr + eepromQueueNext;
+        EEDR = eepromQueue[ eepromQueueNext++ ];
+        EECR = _BV( EERIE ) | _BV( EEMPE );     // Erase and write, keep the interrupt on. EEPE has to follow within 4 clocks.
+        EECR |= _BV( EEPE );
+        
+    } else {
+        
+        CBI( EECR , EERIE );                    // Last byte is done
+        
+    }        
+    
+}    
+
+// True while queued bytes are still being written
+
+static inline uint8_t eepromBusy(void) {
+    return TBI( EECR , EERIE );
+}    
+
+// Wait in idle sleep for the queue to finish
+
+static void eepromFlush(void) {
+    
+    set_sleep_mode( SLEEP_MODE_IDLE );
+    sleep_enable();
+    
+    while (eepromBusy()) {
+        sei();
+        sleep_cpu();
+        cli();
+    }
+    
+}    
+
+// Queue up len (up to EEPROM_QUEUE_SIZE) bytes to write at addr. Returns right away. 
+
+static void eepromQueueBlock(const uint8_t *src, const void *addr, uint8_t len) {
+    
+    eepromFlush();                              // Only one block at a time
+    
+    memcpy( eepromQueue , src , len );
+    
+    eepromQueueAddr = (uintptr_t) addr;
+    eepromQueueLen  = len;
+    eepromQueueNext = 0;
+    
+    SBI( EECR , EERIE );                        // Fires as soon as the EEPROM is ready, which is the next time we sleep
+    
+}    
+
+#ifdef TIMING_BUDGET
+
+// timing_save() is a direct write and TimingBudget.c can't see the queue, so flush here like telemetry_save() does
+
+static void timingSave(void) {
+    
+    eepromFlush();
+    
+    timing_save();
+    
+}    
+
+#else
+
+#define timingSave()
+
+#endif
+
+
+static uint8_t journal_crc(const uint8_t *record)
+{
+    uint8_t crc = 0x00;
+    
+    for (uint8_t i = 0; i < JOURNAL_CRC8; i++) {
+        crc = _crc8_ccitt_update(crc, record[i]);
+    }
+    
+    return crc;
+}
+
+// Where the next journal record goes and what sequence number it gets. Set up by journal_find().
+
+static const uint8_t *journal_next;
+static uint8_t journal_seq;
+
+/*
+ * journal_find() -	Scan the channel journal for the newest valid record.
+ *			Returns !0 and fills in *channel if there is one, 0 if the journal is empty.
+ *			Either way sets up journal_next and journal_seq for the next save.
+ */
+
+static uint8_t journal_find(uint16_t *channel)
+{
+    uint8_t found = 0;
+    uint8_t record[EEPROM_JOURNAL_RECORD_SIZE];
+    const uint8_t *src;
+    
+    eepromFlush();                  // Any record still in the queue has to be in EEPROM before we look
+    
+    journal_next = EEPROM_JOURNAL;
+    journal_seq  = 0;
+    
+    for (src = EEPROM_JOURNAL; src < EEPROM_JOURNAL + (EEPROM_JOURNAL_SLOTS * EEPROM_JOURNAL_RECORD_SIZE); src += EEPROM_JOURNAL_RECORD_SIZE) {
+        
+        eeprom_read_block(record, src, EEPROM_JOURNAL_RECORD_SIZE);
+        
+        if (journal_crc(record) == record[JOURNAL_CRC8]) {
+            
+            // Sequence numbers wrap, so newer means "not more than half way around behind"
+            
+            if (!found || (int8_t)(record[JOURNAL_SEQ] - journal_seq) >= 0) {
+                
+                found = 1;
+                
+                *channel = (record[JOURNAL_CHANNEL_HI] << 8) | record[JOURNAL_CHANNEL_LO];
+                
+                journal_seq  = record[JOURNAL_SEQ] + 1;
+                journal_next = src + EEPROM_JOURNAL_RECORD_SIZE;
+                
+            }
+        }
+    }
+    
+    if (journal_next >= EEPROM_JOURNAL + (EEPROM_JOURNAL_SLOTS * EEPROM_JOURNAL_RECORD_SIZE)) {
+        journal_next = EEPROM_JOURNAL;              // Wrap around the ring
+    }
+    
+    return found;
+}
+
+/*
+ * saved_channel() -	The channel to power up on. The newest journal record if there is one,
+ *			otherwise the one in the working params.
+ */
+
+static uint16_t saved_channel(void)
+{
+    uint16_t channel = params.channel;
+    
+    journal_find(&channel);         // Leaves channel alone if journal is empty
+    
+    return channel;
+}
+
+/*
+ * update_channel() -	Save a new channel by appending a record to the journal.
+ *			The CRC byte is written last, so if we lose power part way through
+ *			the record is invalid and the previous one is used instead.
+ *			Returns before the record is written, see eepromQueueBlock().
+ */
+static void update_channel(uint16_t channel)
+{
+	uint8_t record[EEPROM_JOURNAL_RECORD_SIZE];
+    uint16_t unused;
+    
+    journal_find(&unused);
+    
+    record[JOURNAL_SEQ]        = journal_seq;
+    record[JOURNAL_CHANNEL_LO] = channel & 0xff;
+    record[JOURNAL_CHANNEL_HI] = channel >> 8;
+    record[JOURNAL_CRC8]       = journal_crc(record);
+    
+    eepromQueueBlock(record, journal_next, EEPROM_JOURNAL_RECORD_SIZE);         // Writes in order, so CRC goes last
+    
+    params.channel = channel;
+    
+}
+
+// Note: must read the registers from the FM_IC first with si4702_read_registers_upto_0B()
+// THis gets the current channel after a seek.
+
+/*
+
+Register 0Bh. Read Channel
+
+9:0 READCHAN[9:0] Read Channel.
+READCHAN[9:0] provides the current tuned channel and is updated during a seek
+operation and after a seek or tune operation completes. Spacing and channel are set
+with the bits SPACE 05h[5:4] and CHAN 03h[9:0].
+
+*/
+
+
+static uint16_t currentSeekChanFromShadow(void) {
+    return( get_shadow_reg(REGISTER_0B) & REG_0B_READCHAN_MASK );
+}    
+
+// read the current channel from the RF-IC and save to eeprom. 
+// We need this on a long press to save a new station after a seek.
+// Seeks always run to completion, so this is the real final channel.
+
+static void updateToCurrentChannel(void) {
+    
+    si4702_read_registers_upto_0B();
+    
+    update_channel( currentSeekChanFromShadow() ); 
+    
+}    
+
+
+
+/*
+ * param_crc() -	CRC the first len bytes of the param block in SRAM.
+ *			Over the whole block (including the CRC itself) gives 0x0000 if the CRC (last 2 bytes) is correct.
+ *			Over all but the last 2 bytes gives the CRC to store there.
+ */
+
+static uint16_t param_crc(uint8_t len)
+{
+	uint16_t crc = 0x0000;
+	const uint8_t *src = (const uint8_t *)&params;
+	uint8_t i;
+
+	for (i = 0; i < len; i++, src++) {
+		crc = _crc16_update(crc, *src);
+	}
+    
+    return crc;
 }
 
 /*
- * Just write registers 2 thru 7 inclusive from the shadow array.
+ * check_param_crc() -	Read EEPROM_PARAM_SIZE bytes starting at *base into params,
+ *			and return whether the crc (last 2 bytes) is correct
+ *			or not.
+ *			Return 0 if crc is good, !0 otherwise.
+ */
+
+static uint16_t check_param_crc(const uint8_t *base)
+{
+	uint16_t crc;
+
+    eeprom_read_block(&params, base, EEPROM_PARAM_BLOCK_SIZE);
+    
+    crc = param_crc( EEPROM_PARAM_BLOCK_SIZE );
+
+	/*
+	 * If CRC (last 2 bytes checked) is correct, crc will be 0x0000.
+	 */
+	return crc ;
+}
+
+// The bank params came from (or were last saved to) and its generation. NULL if neither bank was good, 
+// in which case we are running on the factory params. 
+
+static const uint8_t *params_bank;
+static uint8_t params_generation;
+
+/*
+ * load_params() -	Load the newest bank with a good CRC into params and note which one it was.
+ *			Sequence numbers wrap, so newer means "not more than half way around ahead" like the journal.
+ *			If neither bank is good, load the factory params instead. We do not write them back
+ *			here since a bad bank most likely came from a failing battery, and boot is not the time
+ *			to write with one. The next factory reset puts them in a bank anyway. 
+ *			Return 0 if we got good params, !0 if even the factory block is bad.
  */
 
-// Writes registers starting at 0x02 up to and including the specified upto_reg (max 0x09) 
-// No reason to overwrite registers that we have not changed - especially 0x07 which has conflicting
-// documentation about what to write there after powerup. Better to leave it be!
+static uint16_t load_params(void)
+{
+    params_bank = 0;
+    
+    if (!check_param_crc( EEPROM_BANK_B )) {
+        params_bank = EEPROM_BANK_B;
+        params_generation = params.generation;
+    }
+    
+    if (!check_param_crc( EEPROM_BANK_A )) {
+        
+        if (!params_bank || (int8_t)(params.generation - params_generation) >= 0) {
+            params_bank = EEPROM_BANK_A;
+            params_generation = params.generation;
+            return 0;                               // Already in params
+        }            
+        
+    }
+    
+    if (params_bank) {
+        return check_param_crc( params_bank );      // Bank B won, read it again since A is in params now
+    }        
+    
+    return check_param_crc( EEPROM_FACTORY );
+}
 
-static void si4702_write_registers(unsigned upto_reg)
+/*
+ * save_params() -	Save params into the other bank with the next generation number, so the bank in use is never 
+ *			touched. Bytes are written in order so the CRC goes last, and until it is there the old bank still wins.
+ */
+
+static void save_params(void)
 {
-	//USI_TWI_Start_Transceiver_With_Data(0x20, &(shadow[REGISTER_02]), 12);
+    params_bank = (params_bank == EEPROM_BANK_A) ? EEPROM_BANK_B : EEPROM_BANK_A;
+    
+    params.generation = ++params_generation;
+    
+    params.crc16 = param_crc( EEPROM_PARAM_BLOCK_SIZE - sizeof( params.crc16 ) );
+    
+    eepromFlush();                  // Direct write, see the EEPROM write queue
+    
+    eeprom_write_block(&params, (void *)params_bank, EEPROM_PARAM_BLOCK_SIZE);
+}
+
+#ifdef TELEMETRY
+
+// Counted up in RAM and only written out by telemetry_save()
+
+static telemetry_block telemetry;
+
+static uint8_t telemetry_crc(void)
+{
+    uint8_t crc = 0;
+    
+    for (uint8_t i = 0; i < sizeof( telemetry ) - sizeof( telemetry.crc8 ); i++) {
+        crc = _crc8_ccitt_update(crc, ((const uint8_t *) &telemetry)[i]);
+    }
+    
+    return crc;
+}
+
+static void telemetry_load(void)
+{
+    eeprom_read_block(&telemetry, EEPROM_TELEMETRY, sizeof( telemetry ));
+    
+    if (telemetry_crc() != telemetry.crc8) {
+        memset( &telemetry , 0x00 , sizeof( telemetry ) );
+    }
+}
+
+static void telemetry_save(void)
+{
+    eepromFlush();                  // Direct write, see the EEPROM write queue
+    
+    telemetry.crc8 = telemetry_crc();
+    
+    eeprom_update_block(&telemetry, (void *)EEPROM_TELEMETRY, sizeof( telemetry ));
+}
+
+// Works for any size field. Sticks at the max.
+
+#define telemetryCount(field) do { if (!++telemetry.field) telemetry.field--; } while (0)
+
+#else
+
+#define telemetry_load()
+#define telemetry_save()
+#define telemetryCount(field)
+
+#endif
+
+#ifdef SCAN_CACHE
+
+// Channels in the scan cache, loaded by scanCacheLoad(). 0 means no cache so fall back to seekNext().
+
+static uint8_t scanCount;
+
+static uint8_t scan_crc(void)
+{
+    uint8_t crc = _crc8_ccitt_update( 0x00 , LOCALE_BAND | (LOCALE_SPACING << 2) | (LOCALE_DEEMPHASIS << 4) );
+    
+    for (const uint8_t *src = EEPROM_SCAN_CACHE; src < SCAN_CACHE_CRC8; src++) {
+        crc = _crc8_ccitt_update(crc, eeprom_read_byte(src));
+    }
+    
+    return crc;
+}
+
+// Throw away the cache so the next boot scans again. Call whenever the band or spacing might have changed. 
+
+static void scanCacheInvalidate(void) {
+    
+    eepromFlush();                  // Direct write, see the EEPROM write queue
+    
+    eeprom_update_byte( (uint8_t *) EEPROM_SCAN_CACHE , 0xff );
+    
+    scanCount = 0;
+    
+}
+
+// Returns true and sets scanCount if there is a good cache in EEPROM with at least one station
+
+static uint8_t scanCacheLoad(void) {
+    
+    uint8_t count = eeprom_read_byte( EEPROM_SCAN_CACHE );
+    
+    if (count == 0 || count > SCAN_CACHE_SLOTS || scan_crc() != eeprom_read_byte( SCAN_CACHE_CRC8 )) {
+        
+        scanCount = 0;
+        
+        return 0;
+    }
+    
+    scanCount = count;
+    
+    return 1;
+}    
+
+#else
+
+#define scanCacheInvalidate()
+
+#endif
+
+/*
+ * copy_factory_param() -	Copy the factory default parameters into the
+ *				working params by way of params in SRAM, saved
+ *				into the bank not in use. If the factory block is
+ *				bad, leave the working params alone.  
+ */
+
+static void  copy_factory_param(void)
+{
+    load_params();                                  // Find out which bank is in use, may be first thing at boot 
+    
+    if (check_param_crc( EEPROM_FACTORY )) {
+        
+        load_params();                              // Should never happen, the factory block is never written after programming
+        
+        return;
+        
+    }        
+    
+    save_params();
+    
+    // Might be going back to a different band or spacing, so scan again on next boot
+    
+    scanCacheInvalidate();
+    
+    // Also journal the factory channel, otherwise the last saved one would still win at boot
+    
+    update_channel( params.channel );
+}
+
+
+// Peripheral power. main() powers everything down with PRR and each user only powers up what it needs while it needs it:
+// Timer0 in idleFor(), Timer1 for LED PWM in LED_level(), the ADC in adc_on()/adc_off(), and the USI for each transfer
+// in the TWI=usi build (bitbang never uses it). Power down sleep stops these clocks anyway, but idle and ADC sleep and the 
+// time awake do not. In the timing build Timer0 is the clock, so once on it stays on.
+
+#ifdef TIMING_BUDGET
+    #define timer0_power_on()   power_timer0_enable()
+    #define timer0_power_off()
+#else
+    #define timer0_power_on()   power_timer0_enable()
+    #define timer0_power_off()  power_timer0_disable()
+#endif
+
+// Goto bed, will only wake up on button press interrupt (if enabled) or WDT
+// Also turns off the BOD while asleep on parts that can (it just comes back on when we wake up). 
+// sleep_bod_disable() has to be right before the sleep since the BODS bit only lasts 3 clocks.
+
+static void deepSleep(void) {
+	set_sleep_mode( SLEEP_MODE_PWR_DOWN );
+    sleep_enable();
+    sleep_bod_disable();
+    sleep_cpu();        // Good night    
+}  
+
+
+// Count the ticks so buttonWait() can tell how long the button has been down.
+// Otherwise the interrupt itself waking us up is all that matters. 
+
+static volatile uint8_t wdtTicks;
+
+ISR( WDT_vect ) {
+    wdtTicks++;
+}    
+
+#define HOWLONG_16MS   (_BV(WDIE) )
+#define HOWLONG_32MS   (_BV(WDIE) | _BV( WDP0) )
+#define HOWLONG_64MS   (_BV(WDIE) | _BV( WDP1) )
+#define HOWLONG_125MS  (_BV(WDIE) | _BV( WDP1) | _BV( WDP0) )
+#define HOWLONG_250MS  (_BV(WDIE) | _BV( WDP2) )
+#define HOWLONG_500MS  (_BV(WDIE) | _BV( WDP2) | _BV( WDP0) )
+#define HOWLONG_1S     (_BV(WDIE) | _BV( WDP2) | _BV( WDP1) )
+#define HOWLONG_2S     (_BV(WDIE) | _BV( WDP2) | _BV( WDP1) | _BV( WDP0) )
+#define HOWLONG_4S     (_BV(WDIE) | _BV( WDP3) )
+#define HOWLONG_8S     (_BV(WDIE) | _BV( WDP3) | _BV( WDP0) )
+
+// Goto sleep - get woken up by the watchdog timer or other interrupt like button
+// This is very power efficient since chip is stopped except for WDT
+// Note that if the timer was on entering here that it will stay on, so LED will still stay lit.
+
+static void sleepFor( uint8_t howlong ) {
+    
+    eepromFlush();                  // Queued writes would stall in power down
+    
+    wdt_reset();
+    WDTCR =   howlong;              // Enable WDT Interrupt  (WDIE and timeout bits all included in the howlong values)
+    
+    timing_end( TIMING_WAKE );
+    timing_slept( howlong );
+    
+    sei();
+    deepSleep();
+    cli();
+    
+    timing_begin( TIMING_WAKE );
+    
+    WDTCR = 0;                      // Turn off the WDT interrupt (no special sequence needed here)
+                                    // (assigning all bits to zero is 1 instruction and we don't care about the other bits getting clobbered
+    
+}    
+
+
+// Timer0 compare match just stops the timer. This is how idleFor() can tell that the time is up 
+// rather than some other interrupt (like the button) waking us. 
+
+ISR( TIM0_COMPA_vect ) {
+    TCCR0B = 0;                     // Stop Timer0
+}    
+
+// Timer0 runs at F_CPU/1024, so a tick is just over 1ms at 1MHz. 
+// Rounds down so we never wait longer than asked. 
+// Note this is a macro so the math is done at compile time when ms is const, which it should be. 
+
+#define IDLE_TICKS(ms) ((uint16_t) ( ((ms) * (F_CPU/1000UL)) / 1024UL ))
+
+// Wait the specified number of Timer0 ticks in idle sleep.
+// Unlike sleepFor() this is accurate and can do periods shorter than 16ms, and unlike _delay_ms() the 
+// CPU is stopped the whole time so we only pay for the clocks. 
+// Use idleForMs() to get the ticks precomputed. 
+
+static void idleFor( uint16_t ticks ) {
+    
+    timing_idle_start();            // Timer0 is the clock in the timing build, so borrow it
+    
+    timer0_power_on();
+    
+#ifdef TIMING_BUDGET
+    uint16_t idled = ticks;
+#endif
+   
+    TCCR0A = _BV( WGM01 );          // CTC mode, so compare match happens after OCR0A+1 ticks
+    SBI( TIMSK , OCIE0A );          // Enable compare match interrupt 
+    
+    set_sleep_mode( SLEEP_MODE_IDLE );
+    sleep_enable();
+        
+    while (ticks) {
+        
+        uint8_t chunk = (ticks > 0xff) ? 0xff : ticks;       // Timer0 is only 8 bits so do long waits in pieces
+        
+        ticks -= chunk;
+        
+        TCNT0 = 0;
+        OCR0A = chunk - 1;
+        TIFR  = _BV( OCF0A );                   // Clear any stale match so we don't fall right through
+        TCCR0B = _BV( CS02 ) | _BV( CS00 );     // Start timer at clk/1024
         
-    // Only registers 0x02 - 0x07 are relevant for config, and each register is 2 bytes wide
+        while (TCCR0B) {            // ISR clears this when time is up
+            sei();
+            sleep_cpu();            // sei() guarantees the next instruction executes before any interrupt, so no race here 
+            cli();
+        }
+                
+    }
     
-    USI_TWI_Write_Data( FMIC_ADDRESS ,  &(shadow[REGISTER_02]) , ( upto_reg - REGISTER_02 + 2) );
-}
+    CBI( TIMSK , OCIE0A );
+    
+    timer0_power_off();
+    
+    timing_idle_end( idled );
+    
+}    
 
+#define idleForMs(ms) idleFor( IDLE_TICKS(ms) )
 
+#ifdef DYNAMIC_CLOCK
 
-/*
- * Seek thresholds - see Appendix of SiLabs AN230
- * TODO: Set these according to AN284?
- */
-#define	SEEK_RSSI_THRESHOLD	(10)
-#define	SEEK_SNR_THRESHOLD	(2)
-#define SEEK_IMPULSE_THRESHOLD	(4)
+// Change the system clock prescaler (see profile.h). The new value has to be written within 4 clocks of 
+// setting CLKPCE, which is safe here because interrupts are always off in the main thread. 
+// Anything timed in CPU clocks (delays, Timer0, TWI bits) takes 8x longer while slow. 
 
+static void clockSet( uint8_t clkps ) {
+    CLKPR = _BV( CLKPCE );
+    CLKPR = clkps;
+}
 
+#define clockFast() clockSet( CLOCK_FAST_CLKPS )
+#define clockSlow() clockSet( CLOCK_SLOW_CLKPS )
 
+#else
 
-/*
- * update_channel() -	Update the channel stored in the working params.
- *			Just change the 2 bytes @ EEPROM_CHANNEL,
- *			recalculate the CRC, and then write that.
- */
-static void update_channel(uint16_t channel)
-{
-	uint16_t crc = 0x0000;
-	const uint8_t *src;
+#define clockFast()
+#define clockSlow()
 
-	eeprom_write_word((uint16_t *)EEPROM_CHANNEL, channel);
+#endif
 
-	/*
-	 * Spin through the working params, up to but not including the CRC
-	 * calculating the new CRC and write that.
-	 */
-	for (src = EEPROM_WORKING; src < (const uint8_t *)EEPROM_CRC16; src++) {
-		crc = _crc16_update(crc, eeprom_read_byte(src));
-	}
 
-	eeprom_write_word((uint16_t *)EEPROM_CRC16, crc);
+// Set the volume bits in REGISTER_05 and leave the seek threshold, band, and spacing alone.
+// Only touches the shadow, so it goes out with whatever gets flushed next and costs no extra transfer.
+
+static void si4702_set_volume(uint8_t volume) {
+    
+    set_shadow_reg(REGISTER_05, ( get_shadow_reg( REGISTER_05 ) & ~REG_05_VOLUME_MASK ) | volume );
     
 }
 
-// Note: must read the registers from the FM_IC first with si4702_read_registers_upto_0B()
-// THis gets the current channel after a seek.
-
-/*
+// Bring the volume up one step at a time from wherever it is to the param block volume.
+// Unmuting straight to full volume clicks, and if the tune is still going you get a blip of music
+// from wherever the chip is passing through. Coming up from 0 over a couple hundred ms hides both.
+// The station is playing (quietly) from the first step so a change does not sound any slower,
+// and we are in deep sleep between steps so it costs next to nothing. 
+// A button press just wakes us early and makes the ramp a bit quicker. 
 
-Register 0Bh. Read Channel
+#define VOLUME_RAMP_STEP    HOWLONG_16MS        // 15 steps is about 250ms
 
-9:0 READCHAN[9:0] Read Channel.
-READCHAN[9:0] provides the current tuned channel and is updated during a seek
-operation and after a seek or tune operation completes. Spacing and channel are set
-with the bits SPACE 05h[5:4] and CHAN 03h[9:0].
+static void si4702_volume_ramp(void) {
+    
+    uint8_t volume = get_shadow_reg( REGISTER_05 ) & REG_05_VOLUME_MASK;
+    
+    while ( volume < ( params.volume & REG_05_VOLUME_MASK ) ) {
+        
+        sleepFor( VOLUME_RAMP_STEP );
+        
+        si4702_set_volume( ++volume );
+        
+        si4702_flush();
+        
+    }
+    
+}
 
-*/
 
+// Wait for a seek to finish by polling STC, then clear the SEEK bit so the chip is ready for the next one.
+// There is no spare pin for GPIO2, so we sleep between polls instead. A seek can take seconds if it
+// has to go all the way around the band, but we are in deep sleep for almost all of it. 
+// If it takes longer than SEEK_TIMEOUT_MS we give up, and clearing SEEK aborts it.
+// Returns with 0x0A and 0x0B in the shadow so currentSeekChanFromShadow() has the channel we landed on.
 
-static uint16_t currentSeekChanFromShadow(void) {
-    return( get_shadow_reg(REGISTER_0B & 0x1ff));
-}    
+#define SEEK_POLL           HOWLONG_32MS
+#define SEEK_POLL_MS        (32)
+#define SEEK_TIMEOUT_MS     (15000)     // Full band wrap at 100KHz spacing is about 200 channels
 
-// read the current channel from the RF-IC and save to eeprom. 
-// We need this on a long press to save a new station after a seek.
+static void si4702_wait_stc(void) {
+    
+    uint16_t countdown = SEEK_TIMEOUT_MS / SEEK_POLL_MS;
+    
+    do {
+        
+        sleepFor( SEEK_POLL );          // A button press will wake us early, no harm done
+        
+        si4702_read_registers_upto_0B();
+        
+    } while ( !(get_shadow_reg( REGISTER_0A ) & _BV( REG_0A_STC_BIT )) && --countdown );
+    
+}
 
-static void updateToCurrentChannel(void) {
+static void si4702_wait_seek(void) {
     
-    si4702_read_registers_upto_0B();
+    si4702_wait_stc();
     
-    update_channel( currentSeekChanFromShadow() ); 
+    /* 
+    
+    "The STC and SF/BL bits must be set low by setting the SEEK bit low
+    before the next seek or tune may begin/"        
+    */
+    
+    set_shadow_reg(REGISTER_02, REG_02_DEFAULT  );
+    
+    si4702_flush();
     
 }    
 
-
-
-// Issue a seek, come what may.
-// Note that state gets mussy here. We don't check for when the seek ends because it would use
-// previous code space and also checking messes with the RFIC and can cause us to miss stations.
-// We just blindly send the seek command even if there is already a seek in progress. It is going to be ok. 
+// Issue a seek and wait for it to finish.
+// Since we always wait for STC, the chip is never left mid-seek and the channel in 0x0B is 
+// the one we really ended up on. 
 
 // Seek settings taken from original version of this code.
 // TODO: Should we adjust seek settings based on AN284 app note?
 
-static void seekNext(void) {
+static void si4702_seek(void) {
                 
         /* 
     
@@ -390,7 +1232,9 @@ static void seekNext(void) {
                                 
     set_shadow_reg(REGISTER_02, REG_02_DEFAULT  );            
     
-    si4702_write_registers( REGISTER_02 );
+    si4702_flush();
+    
+    // Normally SEEK was already cleared at the end of the last one so this does not send anything.
     
     // Empirically determined that we need this delay.
     // We we follow the stop with a start immediately, it does not work. 
@@ -401,101 +1245,202 @@ static void seekNext(void) {
                 
             
     // Set "SEEK" bit on - begins the seek
+    // Volume goes to 0 in the same write, the ramp brings it back once we land
             
     set_shadow_reg(REGISTER_02, REG_02_DEFAULT | _BV(REG_02__SEEK) );            
     
-    si4702_write_registers( REGISTER_02 );
+    si4702_set_volume( 0 );
+    
+    si4702_flush();
                 
+    si4702_wait_seek();
     
-}    
+}
 
+#ifdef RDS_PI
 
-/*
- * check_param_crc() -	Check EEPROM_PARAM_SIZE bytes starting at *base,
- *			and return whether the crc (last 2 bytes) is correct
- *			or not.
- *			Return 0 if crc is good, !0 otherwise.
- */
+// RDS PI codes, only built with `make RDS=pi`. Every RDS station sends a PI code that says which station it is, 
+// about 11 times a second. A strong local station often gets heard again a channel or two over, and the seek
+// stops there too. If the PI where we land is the one we just left, that is what happened.
+// Standard RDS mode (RDSM clear) only sets RDSR for a group with no uncorrectable errors, so a PI we
+// get is a good one. We sleep between polls like si4702_wait_stc() so this costs a read every 32ms.
 
-static uint16_t check_param_crc(const uint8_t *base)
-{
-	uint16_t crc = 0x0000;
-	uint8_t i;
+#define RDS_PI_POLL     HOWLONG_32MS
+#define RDS_PI_POLLS    (8)             // About 250ms, long enough for the chip to sync and get a few groups
+#define RDS_SEEK_TRIES  (4)             // Give up and stay put after this many stops on the same station
 
-	for (i = 0; i < EEPROM_PARAM_BLOCK_SIZE; i++, base++) {
-		crc = _crc16_update(crc, eeprom_read_byte(base));
-	}
+// PI of the station we are on, 0 if we have not seen one. Lots of stations do not send RDS at all.
 
-	/*
-	 * If CRC (last 2 bytes checked) is correct, crc will be 0x0000.
-	 */
-	return crc ;
+static uint16_t rdsPI;
+
+#define rdsForget() (rdsPI = 0)
+
+// Poll for an RDS group up to polls times, the first one right away. Returns the PI, or 0 if none came.
+
+static uint16_t rdsReadPI(uint8_t polls) {
+    
+    while (1) {
+        
+        si4702_read_registers_upto_0F();
+        
+        if ( get_shadow_reg( REGISTER_0A ) & _BV( REG_0A_RDSR_BIT ) ) {
+            return get_shadow_reg( REGISTER_0C );
+        }
+        
+        if (!--polls) {
+            return 0;
+        }
+        
+        sleepFor( RDS_PI_POLL );        // A button press will wake us early, no harm done
+        
+    }
+    
 }
 
-/*
- * copy_factory_param() -	Copy the factory default parameters into the
- *				working param area  simple bulk copy of the
- *				entire 16 bytes. 
- */
+#else
 
-static void  copy_factory_param(void)
-{
-	const uint8_t *src = EEPROM_FACTORY;
-	uint8_t *dest = (uint8_t *)(EEPROM_WORKING);
-	uint8_t i;
+#define rdsForget()
 
-	for (i = 0; i < EEPROM_PARAM_BLOCK_SIZE; i++, src++, dest++) {
-		eeprom_write_byte(dest, eeprom_read_byte(src));
-	}
+#endif
+
+// Seek to the next station and bring the volume up.
+// The RDS build keeps going, still at volume 0, if we stopped on the station we just left. 
+// If we never saw a PI on that one we can't tell, so the first stop is it just like without RDS.
+
+static void seekNext(void) {
+    
+#ifdef RDS_PI
+    
+    uint16_t fromPI = rdsPI ? rdsPI : rdsReadPI( 1 );            // Usually known from the last seek
+    
+    uint8_t tries = RDS_SEEK_TRIES;
+    
+    do {
+        
+        si4702_seek();
+        
+        rdsPI = rdsReadPI( RDS_PI_POLLS );
+        
+    } while ( fromPI && rdsPI == fromPI && --tries );
+    
+#else
+    
+    si4702_seek();
+    
+#endif
+    
+    si4702_volume_ramp();
+    
 }
 
+#ifdef SCAN_CACHE
 
-// Goto bed, will only wake up on button press interrupt (if enabled) or WDT
+// Tune and wait for STC, so 0x0B has the channel afterwards just like after a seek
 
-static void deepSleep(void) {
-	set_sleep_mode( SLEEP_MODE_PWR_DOWN );
-    sleep_enable();
-    sleep_cpu();        // Good night    
-}  
+static void si4702_tune_wait(uint16_t chan) {
+    
+	set_shadow_reg(REGISTER_03, 0x8000 |  chan );
 
+	si4702_flush();
+    
+    si4702_wait_stc();
+    
+    // Clear TUNE so the chip is ready for the next tune or seek
+    
+	set_shadow_reg(REGISTER_03,  chan );
+	
+	si4702_flush();
+    
+}
 
-// Don't do anything, just the interrupt itself will wake us up
-// TODO: If we ever need more code space, this could be replaced by an IRET in the VECTOR table. 
+// Seek across the whole band with mute on and save every station we stop on to the cache.
+// Seeks have SKMODE set so we stop at the top of the band instead of wrapping around to where we started.
+// The Si4702 only has one tuner so this can't run in the background while playing - it runs once before
+// the first station comes on, and after that the cache is kept in EEPROM until it is invalidated.
+// Uses the same seek thresholds as seekNext(), so the cache has the same stations a seek would find. 
 
-EMPTY_INTERRUPT( WDT_vect );
+#define SCAN_REG_02 ( ( REG_02_DEFAULT & ~_BV( REG_02_DMUTE_BIT ) ) | _BV( REG_02_SKMODE ) )       // Muted, stop at band limit
 
-#define HOWLONG_16MS   (_BV(WDIE) )
-#define HOWLONG_32MS   (_BV(WDIE) | _BV( WDP0) )
-#define HOWLONG_64MS   (_BV(WDIE) | _BV( WDP1) )
-#define HOWLONG_125MS  (_BV(WDIE) | _BV( WDP1) | _BV( WDP0) )
-#define HOWLONG_250MS  (_BV(WDIE) | _BV( WDP2) )
-#define HOWLONG_500MS  (_BV(WDIE) | _BV( WDP2) | _BV( WDP0) )
-#define HOWLONG_1S     (_BV(WDIE) | _BV( WDP2) | _BV( WDP1) )
-#define HOWLONG_2S     (_BV(WDIE) | _BV( WDP2) | _BV( WDP1) | _BV( WDP0) )
-#define HOWLONG_4S     (_BV(WDIE) | _BV( WDP3) )
-#define HOWLONG_8S     (_BV(WDIE) | _BV( WDP3) | _BV( WDP0) )
+static void scanStations(void) {
+    
+    uint8_t count = 0;
+    
+    eepromFlush();                  // Direct writes below, see the EEPROM write queue
+    
+    set_shadow_reg(REGISTER_02, SCAN_REG_02 );
+    
+    si4702_tune_wait( 0 );          // Start at the bottom of the band 
+    
+    while (count < SCAN_CACHE_SLOTS) {
+        
+        _delay_ms(1);               // Same as seekNext(), needs a moment after clearing TUNE or SEEK 
+        
+        set_shadow_reg(REGISTER_02, SCAN_REG_02 | _BV(REG_02__SEEK) );
+        
+        si4702_flush();
+        
+        si4702_wait_stc();
+        
+        set_shadow_reg(REGISTER_02, SCAN_REG_02 );        // Clear SEEK, which also clears STC and SF/BL
+        
+        si4702_flush();
+        
+        if ( get_shadow_reg( REGISTER_0A ) & _BV( REG_0A_SFBL_BIT ) ) break;       // Hit the top of the band (or timed out)
+        
+        eeprom_update_word( (uint16_t *) (SCAN_CACHE_CHANNELS + (count * 2)) , currentSeekChanFromShadow() );
+        
+        count++;
+        
+    }
+    
+    eeprom_update_byte( (uint8_t *) EEPROM_SCAN_CACHE , count );
+    
+    eeprom_update_byte( (uint8_t *) SCAN_CACHE_CRC8 , scan_crc() );         // CRC goes last so a brownout mid-scan just means we scan again 
+    
+    scanCount = count;
+    
+}
 
-// Goto sleep - get woken up by the watchdog timer or other interrupt like button
-// This is very power efficient since chip is stopped except for WDT
-// Note that if the timer was on entering here that it will stay on, so LED will still stay lit.
+// Tune to the first cached station above the one we are on, wrapping around to the bottom of the band.
+// Just one tune, typically 60ms instead of a seek that has to step through every channel in between.
 
-static void sleepFor( uint8_t howlong ) {
+static void nextCachedStation(void) {
     
-    wdt_reset();
-    WDTCR =   howlong;              // Enable WDT Interrupt  (WDIE and timeout bits all included in the howlong values)
+    si4702_read_registers_upto_0B();
     
-    sei();
-    deepSleep();
-    cli();
+    uint16_t current = currentSeekChanFromShadow();
     
-    WDTCR = 0;                      // Turn off the WDT interrupt (no special sequence needed here)
-                                    // (assigning all bits to zero is 1 instruction and we don't care about the other bits getting clobbered
+    uint16_t next = eeprom_read_word( (const uint16_t *) SCAN_CACHE_CHANNELS );        // Wrap to the lowest one if we are above them all 
     
-}    
+    for( uint8_t i = 0; i < scanCount; i++ ) {
+        
+        uint16_t chan = eeprom_read_word( (const uint16_t *) (SCAN_CACHE_CHANNELS + (i * 2)) );
+        
+        if (chan > current) {
+            next = chan;
+            break;
+        }
+        
+    }
+    
+    si4702_set_volume( 0 );         // Goes out with the tune, same as seekNext()
+    
+    rdsForget();
+    
+    si4702_tune_wait( next );
+    
+    si4702_volume_ramp();
+    
+}
+
+#endif
+
 
 
 static void si4702_init(void)
 {
+    timing_begin( TIMING_INIT );
+    
 	/*
 	 * Init the Si4702 as follows:
 	 *
@@ -545,9 +1490,19 @@ static void si4702_init(void)
     // Tested and setting AHIZEN here has no effect on enable click. 
     // Tested setting 07 to XOSCEND | 0x3c04 and chip does not function. 
 
+    // The chip was just reset so its registers are back to their defaults (all 0), but after a
+    // lowBatteryShutdown() resume the shadow still has ENABLE, the channel, and the volume from last time.
+    // Clear the writable shadow back to the reset values, or this write would power up the chip and unmute
+    // before the oscillator settles. Mark everything dirty so it all gets written out. 
+
+    memset( &shadow[REGISTER_02] , 0x00 , REGISTER_09 + 2 - REGISTER_02 );
+
+    shadow_writable = SHADOW_WRITABLE_UPTO_07;
+    shadow_dirty    = SHADOW_WRITABLE_UPTO_07;
+
 	set_shadow_reg(REGISTER_07, 0x8100 );
 
-	si4702_write_registers(REGISTER_07);
+	si4702_flush();
     
     /*
 
@@ -560,8 +1515,38 @@ static void si4702_init(void)
     // UPDATE 11-5-2017: Some units powering up with static in production, so increasing this from 500ms to 600ms
     // and also increasing powerup time in enable from 200ms to 350ms to try and get a margin past the problem.
     // TODO: Walk this back once problem cured to see if this delay was relevant. 
+    // Note that unlike the powerup in enable, there is no status bit we can poll to see when the
+    // oscillator is stable, so this one has to stay a fixed delay. 
+
+	idleForMs(600);
+    
+    timing_end( TIMING_INIT );
+    
+}
+
+// Poll the FM_IC until it says it has finished powering up, or we give up.
+// The firmware version in register 0x01 reads as 0 until the powerup sequence completes,
+// so as soon as it goes non-zero we know the chip is really up and can take a tune.
+// The timeout is the old fixed delay, so worst case we are no slower than before. 
 
-	_delay_ms(600);
+#define FMIC_POWERUP_POLL_MS     (10)       // How often to check. Each check is a 16 byte read.
+#define FMIC_POWERUP_TIMEOUT_MS  (350)      // Give up after this long and carry on anyway 
+
+static void si4702_wait_powerup(void) {
+    
+    uint8_t countdown = FMIC_POWERUP_TIMEOUT_MS / FMIC_POWERUP_POLL_MS;
+    
+    while (countdown--) {
+        
+        idleForMs( FMIC_POWERUP_POLL_MS );
+        
+        si4702_read_registers_upto_01();
+        
+        if ( get_shadow_reg( REGISTER_01 ) & REG_01_FIRMWARE_MASK ) {
+            return;                         // Chip is up
+        }
+        
+    }
     
 }
 
@@ -570,6 +1555,7 @@ static void si4702_init(void)
     
 static void si4702_enable(void) {
     
+    timing_begin( TIMING_ENABLE );
 
     /*    
         Set the ENABLE bit high and the DISABLE bit low to
@@ -583,26 +1569,58 @@ static void si4702_enable(void) {
 //    set_shadow_reg(REGISTER_02, _BV( REG_02_DSMUTE_BIT ) |  _BV( REG_02_ENABLE_BIT ) );    // Setting DSMUTE here doesnt help with click
 
 
+    shadow_writable = SHADOW_WRITABLE_UPTO_06;                  // Never touch REGISTER_07 again after powerup
+
     set_shadow_reg(REGISTER_02,  _BV( REG_02_ENABLE_BIT ) );    // Enable chip
 
 
     // OK, CLICK DEFINATELY HAPPENS ON THIS ENABLE ACTION!!!!
 
-	si4702_write_registers( REGISTER_02 );
+	si4702_flush();
 
        
 	/*
-	 * Set radio params based on eeprom...
+	 * Set radio params based on eeprom (or the build profile)...
+	 */
+    
+	set_shadow_reg(REGISTER_04, (LOCALE_DEEMPHASIS ? _BV( REG_04_DE_BIT ) : 0x0000)
+#ifdef RDS_PI
+            | _BV( REG_04_RDS_BIT )
+#endif
+    );
+    
+	/*
+	 * Seek thresholds from the param block, or the defaults if not set there. Any value is allowed, 0 included.
 	 */
     
-	set_shadow_reg(REGISTER_04, (eeprom_read_byte(EEPROM_DEEMPHASIS) ? _BV( REG_04_DE_BIT ) : 0x0000));
+    uint8_t seek_rssi    = SEEK_RSSI_THRESHOLD;
+    uint8_t seek_snr     = SEEK_SNR_THRESHOLD;
+    uint8_t seek_impulse = SEEK_IMPULSE_THRESHOLD;
+    
+    if (params.flags & _BV( PARAM_FLAG_SEEK_SET )) {
+        
+        seek_rssi    = params.seek_rssi;
+        seek_snr     = params.seek_snr;
+        seek_impulse = params.seek_impulse;
+        
+    }
+    
+    if (params.flags & _BV( PARAM_FLAG_STRONG_ONLY )) {
+        
+        if (seek_rssi    < SEEK_STRONG_RSSI_THRESHOLD)    seek_rssi    = SEEK_STRONG_RSSI_THRESHOLD;
+        if (seek_snr     < SEEK_STRONG_SNR_THRESHOLD)     seek_snr     = SEEK_STRONG_SNR_THRESHOLD;
+        if (seek_impulse < SEEK_STRONG_IMPULSE_THRESHOLD) seek_impulse = SEEK_STRONG_IMPULSE_THRESHOLD;
+        
+    }        
     
     // TODO: These ANDs can go if we ever need room - if these bytes are not 0 padded correctly then something is very wrong. 
 
+    // Volume starts at 0 and si4702_tune() ramps it up once we are playing
+    
 	set_shadow_reg(REGISTER_05,
-			(((uint16_t)(eeprom_read_byte(EEPROM_BAND) & 0x03)) << 6) |
-			(((uint16_t)(eeprom_read_byte(EEPROM_SPACING) & 0x03)) << 4) |
-            (((uint16_t)(eeprom_read_byte(EEPROM_VOLUME) & 0x0f)))           
+            (((uint16_t) seek_rssi) << 8) |                         // SEEKTH
+			(((uint16_t)(LOCALE_BAND & 0x03)) << 6) |
+			(((uint16_t)(LOCALE_SPACING & 0x03)) << 4)
     );
 
     
@@ -614,7 +1632,7 @@ static void si4702_enable(void) {
     // even though we may never need these set (only used if user presses button to seek)
     
 	set_shadow_reg(REGISTER_06,
-			(SEEK_SNR_THRESHOLD << 4) | SEEK_IMPULSE_THRESHOLD);
+			((seek_snr & 0x0f) << 4) | (seek_impulse & 0x0f));             // SKSNR, SKCNT
     
 
     // If we Unmute here, then you hear a blip of music before a click. Arg. 
@@ -622,7 +1640,7 @@ static void si4702_enable(void) {
     // Note that this write looks like it must come before the tune.
     // If we try to batch them into one write then we get no audio. Hmmm. 
     
-	si4702_write_registers( REGISTER_06 );
+	si4702_flush();
 
 
     /*    
@@ -642,9 +1660,11 @@ static void si4702_enable(void) {
     // 200ms next guess, seems to cure problem on unit tested. 
     // UPDATE 11-7-2017:  Maybe 200ms not enough either. Some units in production are still powering up to
     // static so upping this form 200ms to 350ms, and osc delay from 500ms to 600ms. 
-    // TODO: Maybe try polling the chip to see exactly when it wakes up to shorten this?
+    // UPDATE: Now we poll the chip to see exactly when it wakes up, with the 350ms as the timeout.
         
-    _delay_ms(350); 
+    si4702_wait_powerup(); 
+    
+    timing_end( TIMING_ENABLE );
     
 }
 
@@ -657,23 +1677,27 @@ static void si4702_enable(void) {
 
 static void si4702_tune(uint16_t chan)   {
                   
+    timing_begin( TIMING_TUNE );
     
     //uint16_t chan = 0x0040;                                  // test with z100.
     //uint16_t chan = 0x0044;                                  // Test with  - cbs 101 fm
           
+    si4702_set_volume( 0 );         // Already 0 after enable, but not after a factory reset
+    
+    rdsForget();
+    
 	set_shadow_reg(REGISTER_03, 0x8000 |  chan );
 
-	si4702_write_registers( REGISTER_03 );
+	si4702_flush();
     
     // Ok, we should be all set up and tuned here, but still muted. 
            
     // Disable mute, set mono, seek up!
+    // Volume is still 0 so this does not click, the ramp below brings it up.
     
     set_shadow_reg(REGISTER_02,  REG_02_DEFAULT );       
     
-    si4702_write_registers( REGISTER_02 );
-
-    // TODO: Play with this more. Can we get rid of the click here?    
+    si4702_flush();
 
     /*
         The tune operation begins when the TUNE bit is set high. The STC bit is set high
@@ -684,7 +1708,11 @@ static void si4702_tune(uint16_t chan)   {
     // Clear the tune bit here so chip will be ready to tune again if user presses the button.
 	set_shadow_reg(REGISTER_03,  chan );
 	
-	si4702_write_registers( REGISTER_03 );
+	si4702_flush();
+    
+    timing_end( TIMING_TUNE );
+    
+    si4702_volume_ramp();           // The first steps overlap the tune, so the blip is at volume 0
         
 }
 
@@ -697,35 +1725,222 @@ Old tunedirect()
 
 	set_shadow_reg(REGISTER_03, 0x8000 | chan );
 
-	si4702_write_registers( REGISTER_03 );
-	_delay_ms(160);
+	si4702_flush();
+	_delay_ms(160);
+
+    
+    // Clear the tune bit here so chip will be ready to tune again if user presses the button.
+	set_shadow_reg(REGISTER_03,  chan );
+	si4702_flush();
+}
+
+*/
+
+// Returns true if button is down
+
+static inline uint8_t buttonDown(void) {
+    return( !TBI( PINB , BUTTON_INPUT_BIT ));           // Button is pulled high, short to ground when pressed
+}    
+
+
+// LED patterns
+// 
+// A pattern is a table in flash of steps. Each step is a brightness (0-255) and then how long to show it 
+// as one of the HOWLONG_* WDT timeouts. A step with a howlong of 0 ends the pattern and leaves the LED at that
+// brightness, which must be 0 or 255. 
+//
+// Brightness 0 and 255 just drive the pin directly (full brightness even when the battery is low) so we can power 
+// down between steps. Anything in between uses Timer1 PWM on OC1B, which needs idle sleep to keep the timer clocked. 
+// Either way the CPU is asleep for the whole pattern and the WDT steps it. 
+//
+// The steps are not played from inside the WDT (or Timer0) ISR in the background. The main thread sleeps in ledStep()
+// and moves to the next step itself each time the WDT wakes it. Nothing ever has to run while a pattern plays (the
+// callers just wait for it to finish), and this way the main thread keeps running with interrupts off like
+// everywhere else, with no pattern state shared with an ISR. Timer0 is also busy with idleFor().
+
+static const uint8_t PROGMEM ledLongBlink[]  = { 255 , HOWLONG_1S   , 0 , 0 };
+static const uint8_t PROGMEM ledShortBlink[] = { 255 , HOWLONG_125MS, 0 , 0 };
+static const uint8_t PROGMEM ledConfirm[]    = { 255 , HOWLONG_500MS, 0 , 0 };
+static const uint8_t PROGMEM ledCountBlink[] = { 255 , HOWLONG_250MS, 0 , HOWLONG_250MS , 0 , 0 };      // Play n times to blink out n
+
+static const uint8_t PROGMEM ledBadEEPROM[]  = {                 // 3 short blinks 
+    255 , HOWLONG_16MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_16MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_16MS , 0 , HOWLONG_500MS ,
+      0 , HOWLONG_2S   ,
+      0 , 0 
+};    
+
+static const uint8_t PROGMEM ledLowBattery[] = {                 // 2 very quick blinks 
+    255 , HOWLONG_16MS , 0 , HOWLONG_250MS ,
+    255 , HOWLONG_16MS , 0 , HOWLONG_1S ,
+      0 , 0 
+};    
+
+static const uint8_t PROGMEM ledResetAsk[]   = {                 // Quick double blinks for about 4 seconds, press now to confirm 
+    255 , HOWLONG_32MS , 0 , HOWLONG_125MS , 255 , HOWLONG_32MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_32MS , 0 , HOWLONG_125MS , 255 , HOWLONG_32MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_32MS , 0 , HOWLONG_125MS , 255 , HOWLONG_32MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_32MS , 0 , HOWLONG_125MS , 255 , HOWLONG_32MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_32MS , 0 , HOWLONG_125MS , 255 , HOWLONG_32MS , 0 , HOWLONG_500MS ,
+    255 , HOWLONG_32MS , 0 , HOWLONG_125MS , 255 , HOWLONG_32MS , 0 , HOWLONG_500MS ,
+      0 , 0 
+};    
+
+static const uint8_t PROGMEM ledBreathe[]    = {                 // About 2 seconds in and out 
+      8 , HOWLONG_125MS ,  24 , HOWLONG_125MS ,  56 , HOWLONG_125MS , 104 , HOWLONG_125MS , 
+    168 , HOWLONG_125MS , 255 , HOWLONG_250MS , 
+    168 , HOWLONG_125MS , 104 , HOWLONG_125MS ,  56 , HOWLONG_125MS ,  24 , HOWLONG_125MS , 
+      8 , HOWLONG_125MS ,
+      0 , HOWLONG_250MS ,
+      0 , 0 
+};    
+
+static void LED_level( uint8_t level ) {
+    
+    if (level == 0 || level == 255) {
+        
+        GTCCR = 0;                  // Disconnect OC1B so the pin goes back to following PORTB 
+        TCCR1 = 0;                  // Stop Timer1
+        power_timer1_disable();
+
+        if (level) {
+            LED_on();
+        } else {
+            LED_off();
+        }
+        
+    } else {
+        
+        power_timer1_enable();                      // Has to be powered before we can set it up
+        OCR1C = 0xff;                               // TOP
+        OCR1B = level;
+        GTCCR = _BV( PWM1B ) | _BV( COM1B1 );       // PWM on OC1B, high from BOTTOM till compare match 
+        TCCR1 = _BV( CS10 );                        // clk/1 is about 4KHz PWM at 1MHz (500Hz at the slow clock), too fast to see 
+        
+    }        
+    
+}    
+
+// Show one brightness for howlong, asleep. If abortOnButton is set, a button press stops it (LED left off) and we return true. 
 
+static uint8_t ledStep( uint8_t level , uint8_t howlong , uint8_t abortOnButton ) {
     
-    // Clear the tune bit here so chip will be ready to tune again if user presses the button.
-	set_shadow_reg(REGISTER_03,  chan );
-	si4702_write_registers( REGISTER_03 );
-}
-
-*/
+    LED_level( level );
+    
+    uint8_t powerDown = (level == 0 || level == 255);
+        
+    sleep_enable();
+        
+    uint8_t ticks = wdtTicks;
+        
+    wdt_reset();
+    WDTCR = howlong;
+        
+    do {                                    // Other interrupts (like the button) can wake us, so keep going till the WDT fires
+            
+        // Idle keeps Timer1 running for PWM, and lets EE_RDY wake us to write the next queued EEPROM byte.
+        // Once the LED is on or off and the queue is empty we can power down instead. 
+        
+        if (powerDown && !eepromBusy()) {
+            set_sleep_mode( SLEEP_MODE_PWR_DOWN );
+            sleep_bod_disable();            // BOD off while asleep, see deepSleep()
+        } else {
+            set_sleep_mode( SLEEP_MODE_IDLE );
+        }            
+        
+        sei();      
+        sleep_cpu();
+        cli();
+            
+        if (abortOnButton && buttonDown()) {
+            WDTCR = 0;
+            LED_level( 0 );
+            return 1;
+        }                
+            
+    } while (ticks == wdtTicks);
+        
+    WDTCR = 0;
+    
+    return 0;
+    
+}    
 
-// Blink  1 second
+// Play a pattern. If abortOnButton is set, a button press stops it (LED left off) and we return true. 
 
-static void longBlink(void) {
-    LED_on();
-    _delay_ms(1000);
-    LED_off();
+static uint8_t ledPlay( const uint8_t *pattern , uint8_t abortOnButton ) {
+    
+    while (1) {
+        
+        uint8_t level   = pgm_read_byte( pattern++ );
+        uint8_t howlong = pgm_read_byte( pattern++ );
+        
+        if (!howlong) {
+            LED_level( level );
+            return 0;
+        }            
+        
+        if (ledStep( level , howlong , abortOnButton )) {
+            return 1;
+        }            
+        
+    }        
+    
 }    
 
-// Returns true if button is down
+// We are powered by the one-touch programming jig (see VccProg.h). 
+// Listen for frames and save each good one as both the working and factory params, 
+// so a factory reset later goes back to what the jig programmed. Long blink for each good frame.
+// Blinks the protocol version first.
+// Never returns, the jig just cuts power when done. 
 
-static inline uint8_t buttonDown(void) {
-    return( !TBI( PINB , BUTTON_INPUT_BIT ));           // Button is pulled high, short to ground when pressed
+static void programmingMode(void) {
+    
+    for( uint8_t c=VCCPROG_VERSION; c ; c--) {      // Tell the operator which protocol version we speak
+        ledPlay( ledCountBlink , 0 );
+    }        
+    
+    adc_on();
+    
+    while (1) {
+        
+        vccprog_frame frame;
+        
+        if (vccprog_receive( &frame )) {
+        
+            load_params();                              // Just to find the bank in use so we save into the other one 
+        
+            // Start from a blank block so PARAM_FLAG_SEEK_SET is clear (compiled-in seek defaults) and the reserved bytes are 0
+        
+            memset( &params , 0x00 , sizeof( params ) );
+        
+            params.band       = frame.band;
+            params.deemphasis = frame.deemphasis;
+            params.spacing    = frame.spacing;
+            params.channel    = frame.channel;
+            params.volume     = PROGRAMMING_VOLUME;
+        
+            save_params();
+            
+            eeprom_write_block(&params, (void *)EEPROM_FACTORY, EEPROM_PARAM_BLOCK_SIZE);      // Nothing queued since save_params() flushed
+        
+            scanCacheInvalidate();                      // Stations in the cache may not even be in the new band 
+            
+            update_channel( params.channel );           // Newer than anything already in the journal. Queued, so last.
+        
+            ledPlay( ledLongBlink , 0 );
+            
+        }            
+                
+    }        
+    
 }    
 
  
-// Called on button press pin change interrupt
+// Called on button press pin change interrupt, on both edges
 // Do nothing in ISR, just here so we can catch the interrupt and wake form deep sleep
-// ISRs are ugly semantics with volatile access and stuff, simpler to handle in main thread. 
+// ISRs are ugly semantics with volatile access and stuff, simpler to handle in main thread (see buttonWait()). 
 
 // TODO: If we ever need more code space, this could be replaced by an IRET in the VECTOR table. 
 
@@ -770,61 +1985,170 @@ static uint8_t initButton(void)
 
 
 
-// Assumes button is actually down and LED_Timer is on
-// Always waits for the debounced up before returning
-// Call from main assumes that LED will be off when this returns
+// Sleep until the button is released. 
+// Only the pin change can wake us here (the WDT must be off), so this costs nothing no matter how long it is held. 
 
-static void handleButtonDown(void) {
+static void buttonWaitUp(void) {
+    
+    while (buttonDown()) {
+        sei();
+        deepSleep();
+        cli();
+    }
+    
+}    
+
+typedef enum {
+    BUTTON_SHORT_PRESS,         // Released before LONG_PRESS_MS
+    BUTTON_LONG_PRESS,          // Released after LONG_PRESS_MS but before VERYLONG_PRESS_MS
+    BUTTON_VERYLONG_PRESS,      // Released after VERYLONG_PRESS_MS
+    BUTTON_STUCK,               // Held past BUTTON_STUCK_MS, ignore it
+} button_event;
+
+// Assumes button is actually down
+// Always waits for the debounced up before returning, and returns what kind of press it was
+// We power down between edges and WDT ticks, so a long hold costs almost nothing. 
+// The LED comes on when the press is long enough to be a long press, and flashes once it is a very long press
+// so the user knows when to let go. LED is left on for a long press so caller can finish the confirmation.
+
+static button_event buttonWait(void) {
     
     LED_off();                    // Led off when button goes down. Gives feedback if we are currently breathing otherwise benign
     
-    _delay_ms( BUTTON_DEBOUNCE_MS );        // Debounce down
-        
-    uint16_t countdown = LONG_PRESS_MS;
+    idleForMs( BUTTON_DEBOUNCE_MS );        // Debounce down
     
-    while (countdown && buttonDown()) {       // Spin until either long press timeout or they let go
-        _delay_ms(1);          
-        countdown--;
-    }        
+    wdtTicks = 0;
     
-    if (countdown) {                            // Did not timeout, so short press
-        
-        // Advance to next station
+    wdt_reset();
+    WDTCR = BUTTON_TICK;                    // Periodic interrupt every tick for timing the press (WDIE stays set since WDE is not)
+    
+    uint8_t ticks;
+    
+    do {
         
-        // quick blink the LED to let the user know they did something 
-
-        LED_on();
-        _delay_ms(150);
-        LED_off();
+        ticks = wdtTicks;
         
-        seekNext();
+        if (ticks >= VERYLONG_PRESS_TICKS) {
+            
+            if (ticks >= BUTTON_STUCK_TICKS) {
+            
+                // Nobody holds a button this long on purpose. Stop timing and just sleep until they let go.
+                // Fixes the malicious user holding down the button for a few years and blistering the battery. 
+                // Warning sticker no longer needed. 
+                
+                WDTCR = 0;
+                LED_off();
+                buttonWaitUp();
+                break;
                                 
-        // TODO: test this wrap (lots of button presses, so start high!)
+            } else if (ticks & 0x01) {          // Flash to show this will be a very long press
+                LED_on();
+            } else {
+                LED_off();
+            }
+            
+        } else if (ticks >= LONG_PRESS_TICKS) {
+            
+            LED_on();                           // Let the user know they made it to a long press
+            
+        }                    
+        
+        sei();
+        deepSleep();                            // Wake on next tick or edge
+        cli();
         
+    } while (buttonDown());
+    
+    WDTCR = 0;                  // Turn off the WDT interrupt 
+    
+    idleForMs( BUTTON_DEBOUNCE_MS );        // Debounce the most recent up
+    
+    if (ticks >= BUTTON_STUCK_TICKS) {
+        return BUTTON_STUCK;
+    }        
+    
+    if (ticks >= VERYLONG_PRESS_TICKS) {
+        LED_off();
+        return BUTTON_VERYLONG_PRESS;
+    }        
+    
+    if (ticks >= LONG_PRESS_TICKS) {
+        return BUTTON_LONG_PRESS;
+    }
+    
+    return BUTTON_SHORT_PRESS;
         
-    } else {            // Initiated a long-press save to EEPROM            
+}
+
 
-        // When we get here, the button has been down for LONG_PRESS_MS and is still down
+// Handle a button press. Assumes button is actually down.
+// Call from run() assumes that LED will be off when this returns
 
-        // User feedback of long press with long flash on LED
+static void handleButtonDown(void) {
+    
+    switch ( buttonWait() ) {
         
-        LED_on();        
-                            
-        updateToCurrentChannel();      // TODO: This no longer works with seek rather than step.
-                      
-        _delay_ms(500);
+        case BUTTON_SHORT_PRESS:
+        
+            // Advance to next station
+            
+            telemetryCount( seeks );
+        
+            // quick blink the LED to let the user know they did something 
 
-        LED_off();            
+            ledPlay( ledShortBlink , 0 );
+        
+#ifdef SCAN_CACHE
+            if (scanCount) {
                 
+                nextCachedStation();
                 
-        while (buttonDown());           // Wait for them to finally release the button- hopefully after seeing the confirmation long blink
-                                        // Note that we are not checking for low battery voltage here. This means that a malicious user could
-                                        // hold down the button for a few years and cause the battery to blister. Might need to add a warning sticker
-                                        // above button saying "HOLDING BUTTON DOWN FOR MORE THAN 1 YEAR MAY CCAUSE BATTERY DAMAGE"
-                           
-    }    
+            } else
+#endif
+                seekNext();
+                                
+            // TODO: test this wrap (lots of button presses, so start high!)
+            
+            break;
+        
+        case BUTTON_LONG_PRESS:            // Save current station to EEPROM            
 
-    _delay_ms( BUTTON_DEBOUNCE_MS );        // Debounce the most recent up
+            // LED is already on from buttonWait(), leave it on a bit longer as confirmation
+            
+            telemetryCount( saves );
+                                    
+            updateToCurrentChannel();
+                      
+            ledPlay( ledConfirm , 0 );
+            
+            break;
+            
+        case BUTTON_VERYLONG_PRESS:        // Factory reset, but only if they press again to confirm
+        
+            // A 4 second hold is easy to do by accident (in a bag, or by a kid), and the reset throws away
+            // the saved station. So ask with a distinct blink and only go ahead on a second press while it plays. 
+            
+            if (!ledPlay( ledResetAsk , 1 )) {
+                break;                      // No second press, keep everything
+            }
+            
+            buttonWaitUp();                 // Eat the confirming press so it does not look like a seek later
+            
+            idleForMs( BUTTON_DEBOUNCE_MS );
+            
+            copy_factory_param();
+            
+            si4702_tune( saved_channel() );
+            
+            ledPlay( ledLongBlink , 0 );
+            
+            break;
+            
+        case BUTTON_STUCK:                 // Held way too long, probably by accident. Do nothing.
+        
+            break;
+                                    
+    }    
         
 }
 
@@ -843,14 +2167,7 @@ static void badEEPROMBlink(void) {
     
     while (blinkCountDown-- ) {          // Still blinking? Also, a button press will abort the blink cycle
 
-        for( uint8_t c=3; c ; c--) {                // 3 blinks
-            LED_on(); 
-            sleepFor( HOWLONG_16MS);
-            LED_off();
-            sleepFor( HOWLONG_500MS );                // Space between blinks
-        }        
-        
-        sleepFor( HOWLONG_2S );                // Space between blinks
+        ledPlay( ledBadEEPROM , 0 );
         
     }
 
@@ -862,136 +2179,84 @@ static void badEEPROMBlink(void) {
 
 
 // Show the user something went wrong and we are shutting down.
-// Blink the LED _count_ times every second.
-// Continue doing this for at least DIAGNOSTIC_BLINK_SECONDS
-// then go into a mode where we burn about 50uA forever.
-// We need to do this to discharge the decoupling caps
-// se the FM_IC will reset when we do a battery change. 
-
-// It would be nice if pushing the button would just wake up back up, 
-// but the FM_IC seems to need a full power cycle for that to work. 
+// Blink the LED twice every second for at least DIAGNOSTIC_BLINK_TIMEOUT_S (a button press cuts this short).
+// Then keep sleeping, waking every RESUME_CHECK to sample Vcc. 
+// If we see fresh batteries, we return so run() can start over with a reset pulse and full init of the FM_IC.
+// This used to burn power forever to drain the decoupling caps so the FM_IC would get a real power cycle.
 
 static void lowBatteryShutdown(void) {
     
+    timingSave();       // Last chance, Timer0 stays off from here on
+    
+    telemetryCount( low_batteries );
+    telemetry_save();
+    
     LED_off();        // Turn off PWM, we will directly drive the LED from the pin output
     
     
-    // Shutdown all peripherals so save power in deep sleep
+    // Peripherals are already powered down by PRR unless in use (see deepSleep()), so nothing more to shut down here
     // Before 4uA
     // After 4uA
     // Most of this draw is likely from the amp and FM_IC in shutdown modes
-    PRR = _BV( PRTIM1 ) | _BV( PRTIM0) | _BV( PRUSI ) | _BV(PRADC ); 
     
+    // TODO: Add a MOSFET so we can completely shut them off (they still pull about 25uA in reset)?
     
-    while (1) { 
-        
-                
-         
-        // TODO: Test how much current actually used here. Can we lower it with peripheral power control register?
-        // TODO: Add a MOSFET so we can completely shut them off (they still pull about 25uA in reset)?
-    
-        // Turn on interrupts. This will enable wake on button press
-        // which gives uses a way to not have to wait for us to completely run down the
-        // decoupling caps
-    
-        uint8_t blinkCountDown= DIAGNOSTIC_BLINK_TIMEOUT_S;
+    uint8_t blinkCountDown= DIAGNOSTIC_BLINK_TIMEOUT_S;
     
-        while ( blinkCountDown-- &&  !buttonDown() ) {          // Still blinking? Also, a button press will abort the blink cycle
-        
-            // Note that here we directly turn the LED on and off using the pin rather than using
-            // PWM. This is so we can get maximum brightness when the battery voltage is low.
-        
-            // Very quick blink LED twice
-            SBI( PORTB , LED_DRIVE_BIT );
-            sleepFor( HOWLONG_16MS);
-            CBI( PORTB , LED_DRIVE_BIT );
-            
-            _delay_ms(250);                             // Space between blinks. Waste power. 
-            //sleepFor( HOWLONG_250MS );                // Space between blinks
-            SBI( PORTB , LED_DRIVE_BIT );
-            sleepFor( HOWLONG_16MS);
-            CBI( PORTB , LED_DRIVE_BIT );
-            sleepFor( HOWLONG_1S );                // Space between blinks
-        
-        }
-        
+    uint8_t resumeCount = 0;
         
-        while (1) {
-            _delay_ms(10); // Burn power. Ouch this hurts. 
-            sleepFor( HOWLONG_125MS );
-        }
-        
-
-        /*    
-        sei();          // Enable interrupts. This will wake us if the user presses the button to signal they replaced the battery.    
-        deepSleep();
-        cli(); 
-    
-        // Spin and blink while the button is down. We do this for a couple reasons.
-        // 1. Give user feedback that we see the button.
-        // 2. Make sure the button is up by the time we restart so we don't see it down and do a seek or save
-        // 3. If the battery was not changed, this will really kill a dead battery and drop the voltage.
-    
-        while (buttonDown()) {
-
-            SBI( PORTB , LED_DRIVE_BIT );
-            _delay_ms(20);
-            CBI( PORTB , LED_DRIVE_BIT );
-            _delay_ms(20);
+    while (1) { 
         
-        }
+        if (buttonDown()) {                         // A button press will abort the blink cycle
+            blinkCountDown = 0;
+        }                        
         
-        // Now we spend ~255*40ms= 10s blinking craziliy to try and run out the capactors so chip will reset on powerup. 
+        if ( blinkCountDown ) {          // Still blinking? 
         
-        uint8_t delay=255;
+            blinkCountDown--;
         
-        while (delay--) {
-
-            SBI( PORTB , LED_DRIVE_BIT );
-            _delay_ms(20);
-            CBI( PORTB , LED_DRIVE_BIT );
-            _delay_ms(20);
+            // Only full on and off steps, so the pin is driven directly and we get maximum brightness 
+            // when the battery voltage is low. Timer1 is powered down anyway.
             
-        }
+            if (ledPlay( ledLowBattery , 1 )) {
+                blinkCountDown = 0;
+            }                
+            
+        } else {
+            
+            sleepFor( RESUME_CHECK );               // Wakes early on button press, which is fine
+            
+        }            
+                
+        // Did someone put in fresh batteries? 
+        // Dead batteries bounce back up a bit with no load, so we need to see well above LOW_BATTERY_MV_COLD a few times in a row. 
         
-        // If by now we are still runiing, 
+        uint16_t adc = sampleADC();
         
-        */
-    
+        if ( VCC_LESS_THAN_ADC( adc , RESUME_MV ) ) {
+            
+            resumeCount = 0;
+            
+        } else if ( ++resumeCount >= RESUME_COUNT ) {
+            
+            buttonWaitUp();         // Don't let a press from during the swap look like a seek once we are playing
+            
+            return;
+            
+        }                        
+            
     }    
     
-    
-    /*
-
-    //Test to see if we get here
-
-    
-    while (1) {
-
-        SBI( PORTB , LED_DRIVE_BIT );
-        _delay_ms(200);
-        CBI( PORTB , LED_DRIVE_BIT );
-        _delay_ms(200);
-        
-    }
-    
-    
-    */
-        
 }
 
 
 static void debugBlinkDigit(uint8_t c) {
     
     while (c--) {
-        
-        LED_on();
-        _delay_ms(200);
-        LED_off();
-        _delay_ms(200);
+        ledPlay( ledCountBlink , 0 );
     }
     
-    _delay_ms(400);     // Break between high and low digits
+    idleForMs(400);     // Break between high and low digits
     
         
 }    
@@ -1002,7 +2267,7 @@ static void debugBlinkDigit(uint8_t c) {
 static void __attribute__ ((unused)) debugBlinkVoltage(void) {
     
     
-    uint8_t Vcc = ADC2VCC( readADC() ) * 10.0;        // Vcc now *10, so 30 = 3.0v
+    uint8_t Vcc = ADC2VCC_TENTHS( sampleADC() );        // Vcc now *10, so 30 = 3.0v
         
     uint8_t VccT = Vcc/10;          // Break out high and low digits
     
@@ -1011,13 +2276,61 @@ static void __attribute__ ((unused)) debugBlinkVoltage(void) {
         
     debugBlinkDigit(VccB);
     
-    _delay_ms(1000);        // Break between readings
+    idleForMs(1000);        // Break between readings
                 
 }  
 
+// Signal meter for siting the radio. Show the RSSI of the current station as LED brightness, 
+// updated a few times a second. Ends on a button press or after METER_TIMEOUT_MS, whichever is first.
+// Asleep in idle between updates since the PWM needs Timer1 running.
+
+#define METER_STEP          HOWLONG_250MS
+#define METER_STEP_MS       (250)
+#define METER_TIMEOUT_MS    (60000UL)
+#define METER_RSSI_FULL     (60)            // RSSI in dBuV that gets full brightness. Anything this strong is a great signal.
+
+static uint8_t meterRequested;              // Set in main() if the user asked for the meter at power up
+
+static void rssiMeter(void) {
+    
+    uint16_t countdown = METER_TIMEOUT_MS / METER_STEP_MS;
+    
+    while (countdown--) {
+        
+        si4702_read_registers_upto_0B();
+        
+        uint8_t rssi = get_shadow_reg( REGISTER_0A ) & REG_0A_RSSI_MASK;
+        
+        if (rssi > METER_RSSI_FULL) rssi = METER_RSSI_FULL;
+        
+        if (ledStep( ( rssi * 255U ) / METER_RSSI_FULL , METER_STEP , 1 )) {       // Button press ends it
+            
+            buttonWaitUp();                 // Eat the press so it does not seek
+            idleForMs( BUTTON_DEBOUNCE_MS );
+            break;
+            
+        }            
+        
+    }        
+    
+    LED_level( 0 );
+    
+}    
+
+// How many passes of the run() loop between writing the timing totals to EEPROM in the timing build.
+// At 8 seconds a pass that is every 8.5 minutes, which is a few months of continuous play before we get near
+// the EEPROM write endurance. Only the bytes that changed get written.
+
+#define TIMING_SAVE_PASSES  (64)
+
 void run(void) {
+    
+    timing_start();
+    
     SBI( PORTB , FMIC_RESET_BIT );     // Bring FMIC and AMP out of reset
     // The bit direction was set to output when we first started in main()
+    // If we are here again after lowBatteryShutdown(), reset has been held low since we shut down so this finishes the reset pulse
+    // and then si4702_init() sends the whole register sequence again.
     
     _delay_ms(1);                      // When selecting 2-wire Mode, the user must ensure that a 2-wire start condition (falling edge of SDIO while SCLK is
                                        // high) does not occur within 300 ns before the rising edge of RST.
@@ -1028,16 +2341,12 @@ void run(void) {
     // We do a check here because init on FM_IC takes 500ms, so by the time we get here
     // power has stabilized but we do want to check before the amp starts playing music.
 
-    adc_on();
-    
-    if (VCC_LESS_THAN( LOW_BATTERY_VOLTAGE_COLD )) {
+    if (VCC_LESS_THAN( LOW_BATTERY_MV_COLD )) {
         
 
         // Disable FMIC and AMP
         CBI( PORTB , FMIC_RESET_BIT);    // drive reset low, makes them sleep. DDR is set output on start-up and never changed.
         
-        adc_off();
-        
         lowBatteryShutdown();
         
         return;
@@ -1047,9 +2356,27 @@ void run(void) {
             
     si4702_enable();            // Finish bringing up the FM_IC (it will still be muted)
     
-    uint16_t chan = eeprom_read_word(EEPROM_CHANNEL);       // Assumes this does not have bit 15 set.
+    uint16_t chan = saved_channel();       // Assumes this does not have bit 15 set.
+
+#ifdef SCAN_CACHE
+    
+    if (!scanCacheLoad()) {
+        
+        scanStations();         // First boot since programming or factory reset, still muted so this is silent
+        
+    }        
+    
+#endif
 
     si4702_tune( chan );        // Tune up the programmed station and start playing
+    
+    if (meterRequested) {
+        
+        meterRequested = 0;     // Only once, not again if we come back after a low battery
+        
+        rssiMeter();
+        
+    }        
         
     // Radio is now on and tuned
     
@@ -1057,17 +2384,49 @@ void run(void) {
     
     uint8_t warm_low_count=0;                    // How many times in a row has the warm voltage been too low?
     
+#ifdef TIMING_BUDGET
+    uint8_t timingSaveCountdown = TIMING_SAVE_PASSES;
+#endif
+
+#ifdef TELEMETRY
+    uint8_t playSeconds = 0;                    // Toward the next telemetry.play_minutes
+    uint8_t telemetrySaveCountdown = TELEMETRY_SAVE_MINUTES;      // Minutes to the next telemetry_save()
+#endif
+    
+    // From here on we mostly just sample Vcc and sleep, which works fine at the slow clock
+    
+    clockSlow();
+    
     while (1) {
         
-        // This loop cycles every second 
+        // This loop cycles every 1 to 8 seconds depending on the battery (or sooner on a button press)
+        
+        uint16_t adc = sampleADC();             // ADC is only on for this one sample
+        
+#ifdef TELEMETRY
+        if (adc > telemetry.vcc_adc_max) {
+            telemetry.vcc_adc_max = adc;
+        }
+#endif
+        
+#ifdef TIMING_BUDGET
+        if (!--timingSaveCountdown) {
+            timingSave();
+            timingSaveCountdown = TIMING_SAVE_PASSES;
+        }
+#endif
+        
+        uint8_t howlong;                        // How long to sleep before next check
                 
         // Constantly check battery and shutdown if low
                 
-        if  (VCC_LESS_THAN( LOW_BATTERY_VOLTAGE_WARM )) {
+        if  (VCC_LESS_THAN_ADC( adc , LOW_BATTERY_MV_WARM )) {
+            
+            howlong = HOWLONG_1S;
             
             warm_low_count++;
             
-            if (warm_low_count>=LOW_BATTERY_VOLTAGE_WARM_COUNT) {
+            if (warm_low_count>=LOW_BATTERY_WARM_COUNT) {
                 
                 // Only shutdown if we see a consecutive series of low voltage samples to avoid
                 // false alarm due to temp low voltage from a current spike.
@@ -1075,10 +2434,10 @@ void run(void) {
                 // Disable FMIC and AMP
                 CBI( PORTB , FMIC_RESET_BIT);    // drive reset low, makes them sleep. DDR is set output on start-up and never changed.
                                                
-                adc_off();
-                
                 LED_off();        // Turn off LED PWM
                 
+                clockFast();      // lowBatteryShutdown() uses idleFor(), and run() starts over at full speed
+                
                 lowBatteryShutdown();
                 
                 return;
@@ -1093,13 +2452,43 @@ void run(void) {
             
             warm_low_count=0;
             
+            if (VCC_LESS_THAN_ADC( adc , BATTERY_CHECK_FAST_BELOW_MV )) {
+                howlong = HOWLONG_1S;
+            } else if (VCC_LESS_THAN_ADC( adc , BATTERY_CHECK_SLOW_ABOVE_MV )) {
+                howlong = HOWLONG_4S;
+            } else {
+                howlong = HOWLONG_8S;
+            }
+            
+        }
+        
+#ifdef TELEMETRY
+        
+        // Approximate. Breaths, button presses, and early wakes all count as the sleep we meant to do, since nothing
+        // is left running to time them. dump_eeprom.py shows it as approximate.
+        
+        playSeconds += (howlong == HOWLONG_8S) ? 8 : (howlong == HOWLONG_4S) ? 4 : 1;
+        
+        if (playSeconds >= 60) {
+            playSeconds -= 60;
+            telemetryCount( play_minutes );
+            if (!--telemetrySaveCountdown) {
+                telemetry_save();
+                telemetrySaveCountdown = TELEMETRY_SAVE_MINUTES;
+            }
         }
+        
+#endif
                 
         
         if (buttonDown()) {
             
+            clockFast();                // Button timing and TWI to the FM_IC need the full clock
+            
             handleButtonDown();
             
+            clockSlow();
+            
             // Every time the button is pressed we start the LED light countdown over
             // !! commenting out to avoid turning the LED on ever time we change stations
             
@@ -1108,27 +2497,21 @@ void run(void) {
         }
         
         
-        // Light LED so user knows we are alive in case not tuned to a good station or volume too low
-        // Each pass though the while loop in this stage takes about 20ms
+        // Breathe the LED so user knows we are alive in case not tuned to a good station or volume too low
 
         
         if (ledCountdown) {
             
-            LED_on();               // Blindly turn on even though might already be on becuase it takes longer to check than do
-                        
             ledCountdown--;
             
-            if (!ledCountdown) {
-                
-                LED_off();
-                
-            }  
+            ledPlay( ledBreathe , 1 );      // Asleep for the whole breath, and stops early if the button goes down
+                        
+        } else {    
             
-        }               
+            sleepFor( howlong );      // Do nothing for a while before checking low battery again (will wake instantly on button press) to save power
+            // The CPU only used a few microamps for this 8 seconds, which should help extend battery life.
             
-        sleepFor( HOWLONG_1S );      // Do nothing for a while before checking low battery again (will wake instantly on button press) to save power
-        // We actually do not need to check the battery this often, this is just the longest the watchdog timer can sleep for
-        // The CPU only used a few microamps for this 8 seconds, which should help extend battery life.
+        }            
             
                 
     }
@@ -1141,11 +2524,20 @@ int main(void) {
     // This eliminates the need for the external pull-down on this line. 
         
     SBI( DDRB , FMIC_RESET_BIT);    // drive reset low, makes them sleep            
+    
+    power_all_disable();            // Everything gets powered up only while in use, see deepSleep()
         
 	SBI( DDRB , LED_DRIVE_BIT);    // Set LED pin to output, will default to low (LED off) on startup
                                    // Keeps input pin from floating and toggling unnecessarily and wasting power
                                        
-    _delay_ms(50);                 // Debounce the on switch
+    idleForMs(50);                 // Debounce the on switch
+    
+    if (!VCC_LESS_THAN( VCCPROG_MV )) {       // No battery can make this much, must be on the programming jig
+        
+        programmingMode();
+        // Never get here
+        
+    }        
         
     // TODO: Test shutdown current on a new PCB that lets us hold the amp in reset
                                                                                                                             
@@ -1157,33 +2549,54 @@ int main(void) {
         // Better to wait for release, and then a 2nd long press to save after you hear that it works. 
         // Definitely harder to implement because we need a working EEPROM image. 
         
-        // Wait for release
+        // Wait for release. If they held it long enough to see the LED flash then they want the signal meter,
+        // otherwise a factory reset. Stuck buttons get neither. 
         
-        while (buttonDown());
+        switch ( buttonWait() ) {
+            
+            case BUTTON_SHORT_PRESS:
+            case BUTTON_LONG_PRESS:
                             
-        copy_factory_param();       // Revert to initial config
+                copy_factory_param();       // Revert to initial config
         
-        longBlink();
+                ledPlay( ledLongBlink , 0 );
         
-        // Factory config now loaded into working config. Continue as you were...        
+                // Factory config now loaded into working config. Continue as you were...        
+                
+                break;
+                
+            case BUTTON_VERYLONG_PRESS:
+            
+                meterRequested = 1;         // Show signal meter once we are playing
+                
+                break;
+                
+            case BUTTON_STUCK:
+            
+                break;
+                
+        }            
                         
     }   
                           
-    // Now lets check if the working EEPROM settings are corrupted
+    // Now lets load the working EEPROM settings, falling back to the factory ones if both banks are corrupted
     // We do this *after* the factory reset test, see why?
     
-    if (check_param_crc( EEPROM_WORKING )) {
+    if (load_params()) {
         
-        // Must be inside a nuclear power reactor...
+        // Must be inside a nuclear power reactor... both banks and the factory block are bad
         
         // Tell user we are in trouble and then go to sleep
         // This is nice because at least we get some feedback that EEPROMS are corrupting.
-        // Do not try to rewrite EEPROM settings, let the user do that manually with a factory reset.
+        // Do not try to rewrite EEPROM settings, they need reprogramming.
         
         badEEPROMBlink();
                 
     }        
     
+    telemetry_load();
+    telemetryCount( power_ons );                // Goes out with the first save, an hour into play
+    
     while (1) {        
         
         // In here, we try to run but if battery is low then we turn off radio and sleep until a button press and then return.
@@ -0,0 +1,77 @@
+/***
+
+Build profile for the TPR firmware
+
+Everything that has to agree across files at compile time lives here, so include this first in every
+.c file instead of defining things locally.
+
+The clock...
+
+    F_CPU is the one definition of the CPU clock. Delays, idle ticks, the TWI bus timings, and the
+    programming jig timings are all worked out from it. The fuses ship as the 8MHz RC divided by 8.
+
+    `make CLOCK=dynamic` drops the clock to F_CPU_SLOW once we are playing, and only goes back to F_CPU
+    for button handling and anything else that talks to the FM_IC or times things with Timer0. Delays and
+    idle waits are 8x longer while slow, so only code that knows it is slow should run then. The ADC
+    picks its prescaler from CLKPR so it works at either speed.
+
+The locale...
+
+    By default band, spacing, and deemphasis come from the param block in EEPROM, so one image works
+    anywhere and the jig or eeprom.py sets the locale. A locale profile fixes them at build time instead,
+    so the REGISTER_04/05 setup folds down to constants and the code to fetch them goes away. Pick one
+    with `make PROFILE=us`, `PROFILE=eu`, or `PROFILE=jp`. The param block fields are still written by
+    the jig and eeprom.py but are ignored by a locale build.
+
+    Values are the raw Si4702 field values from AN230...
+
+        BAND        0=87.5-108MHz, 1=76-108MHz, 2=76-90MHz
+        SPACING     0=200kHz, 1=100kHz, 2=50kHz
+        DEEMPHASIS  0=75us, 1=50us
+
+***/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#ifndef F_CPU
+    #define F_CPU   1000000UL
+#endif
+
+#ifdef DYNAMIC_CLOCK
+
+    #if F_CPU != 1000000UL
+        #error DYNAMIC_CLOCK assumes the 8MHz RC divided by 8 for F_CPU
+    #endif
+
+    #ifdef TIMING_BUDGET
+        #error The timing build counts Timer0 ticks, which are 8x longer at the slow clock
+    #endif
+
+    #define CLOCK_FAST_CLKPS    3           // 8MHz/8 = F_CPU, same as the CKDIV8 fuse sets at reset
+    #define CLOCK_SLOW_CLKPS    6           // 8MHz/64
+    #define F_CPU_SLOW          125000UL
+
+#endif
+
+#if defined( PROFILE_US )           // Americas
+
+    #define PROFILE_BAND        0
+    #define PROFILE_SPACING     0
+    #define PROFILE_DEEMPHASIS  0
+
+#elif defined( PROFILE_EU )         // Europe, Africa, most of Asia
+
+    #define PROFILE_BAND        0
+    #define PROFILE_SPACING     1
+    #define PROFILE_DEEMPHASIS  1
+
+#elif defined( PROFILE_JP )         // Japan wide band
+
+    #define PROFILE_BAND        1
+    #define PROFILE_SPACING     1
+    #define PROFILE_DEEMPHASIS  1
+
+#endif
+
+#endif
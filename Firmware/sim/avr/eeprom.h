@@ -0,0 +1,32 @@
+/***
+
+Host simulation stand-in for <avr/eeprom.h>
+
+Backed by sim_eeprom[] in sim.c, which counts every byte actually written.
+
+***/
+
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EEMEM
+
+uint8_t  eeprom_read_byte( const uint8_t *addr );
+uint16_t eeprom_read_word( const uint16_t *addr );
+void     eeprom_read_block( void *dst , const void *src , size_t n );
+
+void     eeprom_write_byte( uint8_t *addr , uint8_t value );
+void     eeprom_write_word( uint16_t *addr , uint16_t value );
+void     eeprom_write_block( const void *src , void *dst , size_t n );
+
+void     eeprom_update_byte( uint8_t *addr , uint8_t value );
+void     eeprom_update_word( uint16_t *addr , uint16_t value );
+void     eeprom_update_block( const void *src , void *dst , size_t n );
+
+#define eeprom_is_ready()   (1)
+#define eeprom_busy_wait()
+
+#endif
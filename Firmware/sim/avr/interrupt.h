@@ -0,0 +1,21 @@
+/***
+
+Host simulation stand-in for <avr/interrupt.h>
+
+ISRs become plain functions that sim.c calls when the interrupt fires. sei() and cli() just set the
+flag that sleep_cpu() checks, since the firmware only ever takes interrupts while asleep. 
+
+***/
+
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include "../sim.h"
+
+#define ISR(vector)             void vector(void); void vector(void)
+#define EMPTY_INTERRUPT(vector) void vector(void); void vector(void) {}
+
+#define sei()   (sim_interrupts = 1)
+#define cli()   (sim_interrupts = 0)
+
+#endif
@@ -0,0 +1,216 @@
+/***
+
+Host simulation stand-in for <avr/io.h>
+
+Registers are plain variables defined in sim.c. The simulator looks at them whenever virtual time passes
+(in _delay_*() and sleep_cpu()), which is often enough for everything the firmware does. Writes that mean
+something special on the real chip (like writing 1 to clear a flag) are just stored, so the simulator never
+uses those registers for its own state. 
+
+Bit numbers are from the ATTINY25/45/85 datasheet.
+
+***/
+
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+#define __AVR_ATtiny25__    1
+
+#define _BV(bit)    (1 << (bit))
+
+#define SIM_REG(name) extern volatile uint8_t name
+
+SIM_REG(PORTB); SIM_REG(DDRB); SIM_REG(PINB);
+SIM_REG(GIMSK); SIM_REG(GIFR); SIM_REG(PCMSK);
+SIM_REG(MCUCR); SIM_REG(MCUSR); SIM_REG(SREG);
+SIM_REG(WDTCR); SIM_REG(PRR); SIM_REG(CLKPR);
+SIM_REG(ADMUX); SIM_REG(ADCSRA); SIM_REG(ADCSRB);
+SIM_REG(TCCR0A); SIM_REG(TCCR0B); SIM_REG(TCNT0); SIM_REG(OCR0A); SIM_REG(OCR0B);
+SIM_REG(TIMSK); SIM_REG(TIFR); SIM_REG(GTCCR);
+SIM_REG(TCCR1); SIM_REG(TCNT1); SIM_REG(OCR1A); SIM_REG(OCR1B); SIM_REG(OCR1C);
+SIM_REG(USIDR); SIM_REG(USIBR); SIM_REG(USISR); SIM_REG(USICR);
+SIM_REG(EECR); SIM_REG(EEDR);
+
+extern volatile uint16_t ADC;
+extern volatile uint16_t EEAR;
+
+// Port B
+
+#define PB0     0
+#define PB1     1
+#define PB2     2
+#define PB3     3
+#define PB4     4
+#define PB5     5
+
+#define PORTB0  0
+#define PORTB1  1
+#define PORTB2  2
+#define PORTB3  3
+#define PORTB4  4
+#define PORTB5  5
+
+#define PINB0   0
+#define PINB1   1
+#define PINB2   2
+#define PINB3   3
+#define PINB4   4
+#define PINB5   5
+
+// Pin change interrupt
+
+#define PCINT0  0
+#define PCINT1  1
+#define PCINT2  2
+#define PCINT3  3
+#define PCINT4  4
+#define PCINT5  5
+
+#define INT0    6
+#define PCIE    5
+#define INTF0   6
+#define PCIF    5
+
+// MCUCR
+
+#define BODS    7
+#define PUD     6
+#define SE      5
+#define SM1     4
+#define SM0     3
+#define BODSE   2
+#define ISC01   1
+#define ISC00   0
+
+// Watchdog
+
+#define WDIF    7
+#define WDIE    6
+#define WDP3    5
+#define WDCE    4
+#define WDE     3
+#define WDP2    2
+#define WDP1    1
+#define WDP0    0
+
+// Power reduction
+
+#define PRTIM1  3
+#define PRTIM0  2
+#define PRUSI   1
+#define PRADC   0
+
+#define CLKPCE  7
+#define CLKPS3  3
+#define CLKPS2  2
+#define CLKPS1  1
+#define CLKPS0  0
+
+// ADC
+
+#define REFS1   7
+#define REFS0   6
+#define ADLAR   5
+#define REFS2   4
+#define MUX3    3
+#define MUX2    2
+#define MUX1    1
+#define MUX0    0
+
+#define ADEN    7
+#define ADSC    6
+#define ADATE   5
+#define ADIF    4
+#define ADIE    3
+#define ADPS2   2
+#define ADPS1   1
+#define ADPS0   0
+
+// Timer0
+
+#define COM0A1  7
+#define COM0A0  6
+#define COM0B1  5
+#define COM0B0  4
+#define WGM01   1
+#define WGM00   0
+
+#define FOC0A   7
+#define FOC0B   6
+#define WGM02   3
+#define CS02    2
+#define CS01    1
+#define CS00    0
+
+#define OCIE1A  6
+#define OCIE1B  5
+#define OCIE0A  4
+#define OCIE0B  3
+#define TOIE1   2
+#define TOIE0   1
+
+#define OCF1A   6
+#define OCF1B   5
+#define OCF0A   4
+#define OCF0B   3
+#define TOV1    2
+#define TOV0    1
+
+#define TSM     7
+#define PWM1B   6
+#define COM1B1  5
+#define COM1B0  4
+#define FOC1B   3
+#define FOC1A   2
+#define PSR1    1
+#define PSR0    0
+
+// Timer1
+
+#define CTC1    7
+#define PWM1A   6
+#define COM1A1  5
+#define COM1A0  4
+#define CS13    3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+
+// USI
+
+#define USISIE  7
+#define USIOIE  6
+#define USIWM1  5
+#define USIWM0  4
+#define USICS1  3
+#define USICS0  2
+#define USICLK  1
+#define USITC   0
+
+#define USISIF  7
+#define USIOIF  6
+#define USIPF   5
+#define USIDC   4
+#define USICNT3 3
+#define USICNT2 2
+#define USICNT1 1
+#define USICNT0 0
+
+// EEPROM
+
+#define EEPM1   5
+#define EEPM0   4
+#define EERIE   3
+#define EEMPE   2
+#define EEPE    1
+#define EERE    0
+
+#ifndef E2END
+    #define E2END   0x7f        // ATTINY25, build with -DE2END=0xff to simulate an ATTINY45
+#endif
+
+#define RAMEND  0xdf
+
+#endif
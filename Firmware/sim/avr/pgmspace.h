@@ -0,0 +1,17 @@
+/***
+
+Host simulation stand-in for <avr/pgmspace.h>. Flash is just memory here.
+
+***/
+
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(addr)     (*(const uint8_t *)(addr))
+#define pgm_read_word(addr)     (*(const uint16_t *)(addr))
+
+#endif
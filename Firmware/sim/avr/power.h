@@ -0,0 +1,25 @@
+/***
+
+Host simulation stand-in for <avr/power.h>
+
+Just sets and clears the PRR bits. sim.c stops Timer0 and the ADC while their bits are set, like the chip.
+
+***/
+
+#ifndef SIM_AVR_POWER_H
+#define SIM_AVR_POWER_H
+
+#include <avr/io.h>
+
+#define power_adc_enable()      (PRR &= ~_BV( PRADC ))
+#define power_adc_disable()     (PRR |= _BV( PRADC ))
+#define power_usi_enable()      (PRR &= ~_BV( PRUSI ))
+#define power_usi_disable()     (PRR |= _BV( PRUSI ))
+#define power_timer0_enable()   (PRR &= ~_BV( PRTIM0 ))
+#define power_timer0_disable()  (PRR |= _BV( PRTIM0 ))
+#define power_timer1_enable()   (PRR &= ~_BV( PRTIM1 ))
+#define power_timer1_disable()  (PRR |= _BV( PRTIM1 ))
+#define power_all_enable()      (PRR &= ~( _BV( PRADC ) | _BV( PRUSI ) | _BV( PRTIM0 ) | _BV( PRTIM1 ) ))
+#define power_all_disable()     (PRR |= _BV( PRADC ) | _BV( PRUSI ) | _BV( PRTIM0 ) | _BV( PRTIM1 ))
+
+#endif
@@ -0,0 +1,25 @@
+/***
+
+Host simulation stand-in for <avr/sleep.h>
+
+sleep_cpu() is where virtual time passes until the next enabled interrupt.
+
+***/
+
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#include "../sim.h"
+
+#define SLEEP_MODE_IDLE         0
+#define SLEEP_MODE_ADC          1
+#define SLEEP_MODE_PWR_DOWN     2
+
+#define set_sleep_mode(mode)    (sim_sleep_mode = (mode))
+#define sleep_enable()          (MCUCR |= _BV( SE ))
+#define sleep_disable()         (MCUCR &= ~_BV( SE ))
+#define sleep_bod_disable()     do { } while (0)
+#define sleep_cpu()             sim_sleep()
+#define sleep_mode()            do { sleep_enable(); sleep_cpu(); sleep_disable(); } while (0)
+
+#endif
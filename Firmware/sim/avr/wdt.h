@@ -0,0 +1,14 @@
+/***
+
+Host simulation stand-in for <avr/wdt.h>
+
+***/
+
+#ifndef SIM_AVR_WDT_H
+#define SIM_AVR_WDT_H
+
+#include "../sim.h"
+
+#define wdt_reset()     sim_wdt_reset()
+
+#endif
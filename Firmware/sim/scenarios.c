@@ -0,0 +1,337 @@
+/***
+
+Scenarios for the host simulation, and the main() that runs them
+
+Each scenario runs in its own child process, since the firmware has static state and never returns.
+Run with no arguments for all of them, or give scenario names to run just those.
+
+***/
+
+#undef main                 // The Makefile renames the firmware's main() for every file in the build, but this one is ours
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <avr/io.h>
+#include <util/crc16.h>
+
+#include "sim.h"
+
+#define SIM_HANG_S      (60)            // Real seconds before we decide the firmware is stuck in a loop that never delays or sleeps
+
+// Same layout as the firmware param_block and eeprom.py
+
+#define PARAM_BLOCK_SIZE    (16)
+#define EEPROM_BANK_A       (0x00)
+#define EEPROM_FACTORY      (0x10)
+#define EEPROM_BANK_B       (0x60)
+
+#define JOURNAL_ADDR        (0x70)
+#define JOURNAL_SLOTS       (4)
+#define JOURNAL_RECORD_SIZE (4)
+
+// Some stations in the US band at 200kHz spacing (channel 0 is 87.5MHz), some with RDS
+
+static const sim_station stations[] = {
+    {   8 , 40 , 0x1101 },  //  89.1
+    {  17 , 22 , 0      },  //  90.9
+    {  32 , 12 , 0      },  //  93.9
+    {  40 , 48 , 0x1104 },  //  95.5
+    {  64 , 35 , 0x1105 },  // 100.3
+    {  80 , 30 , 0x1106 },  // 103.5
+    {  84 ,  8 , 0      },  // 104.3, weak
+    {  97 , 26 , 0x1108 },  // 106.9
+};
+
+#define STATION_COUNT   (sizeof( stations ) / sizeof( stations[0] ))
+
+// Same, but 103.5 is also heard on the next channel up, strong enough for a seek to stop there
+
+static const sim_station ghost_stations[] = {
+    {   8 , 40 , 0x1101 },
+    {  17 , 22 , 0      },
+    {  32 , 12 , 0      },
+    {  40 , 48 , 0x1104 },
+    {  64 , 35 , 0x1105 },
+    {  80 , 30 , 0x1106 },
+    {  81 , 14 , 0x1106 },  // 103.7, really 103.5
+    {  84 ,  8 , 0      },
+    {  97 , 26 , 0x1108 },
+};
+
+// Fresh EEPROM like older eeprom.py images, US band and no seek thresholds so the firmware defaults apply. Bank B and the journal are left erased.
+
+static void program_eeprom( uint16_t channel ) {
+
+    uint8_t block[ PARAM_BLOCK_SIZE ];
+
+    memset( sim_eeprom , 0xff , SIM_EEPROM_SIZE );
+
+    memset( block , 0x00 , sizeof( block ) );
+
+    block[3] = channel & 0xff;
+    block[4] = channel >> 8;
+    block[5] = 0x0f;                    // Volume
+
+    uint16_t crc = 0;
+
+    for (uint8_t i = 0; i < PARAM_BLOCK_SIZE - 2; i++) {
+        crc = _crc16_update( crc , block[i] );
+    }
+
+    block[14] = crc & 0xff;
+    block[15] = crc >> 8;
+
+    memcpy( &sim_eeprom[ EEPROM_BANK_A ] , block , PARAM_BLOCK_SIZE );
+    memcpy( &sim_eeprom[ EEPROM_FACTORY ] , block , PARAM_BLOCK_SIZE );
+
+}
+
+// True if the param block at addr has a good CRC
+
+static int bank_good( uint8_t addr ) {
+
+    uint16_t crc = 0;
+
+    for (uint8_t i = 0; i < PARAM_BLOCK_SIZE; i++) {
+        crc = _crc16_update( crc , sim_eeprom[ addr + i ] );
+    }
+
+    return crc == 0;
+
+}
+
+// The bank the firmware will load, same rules as load_params()
+
+static uint8_t params_addr( void ) {
+
+    int a = bank_good( EEPROM_BANK_A );
+    int b = bank_good( EEPROM_BANK_B );
+
+    if (a && (!b || (int8_t) (sim_eeprom[ EEPROM_BANK_A + 9 ] - sim_eeprom[ EEPROM_BANK_B + 9 ]) >= 0)) return EEPROM_BANK_A;
+    if (b) return EEPROM_BANK_B;
+
+    return EEPROM_FACTORY;
+
+}
+
+// The channel the firmware will power up on next time, same rules as saved_channel()
+
+static int saved_channel( void ) {
+
+    int newest = -1;
+    uint8_t newest_seq = 0;
+
+    for (uint8_t slot = 0; slot < JOURNAL_SLOTS; slot++) {
+
+        const uint8_t *record = &sim_eeprom[ JOURNAL_ADDR + (slot * JOURNAL_RECORD_SIZE) ];
+
+        uint8_t crc = 0;
+
+        for (uint8_t i = 0; i < 3; i++) {
+            crc = _crc8_ccitt_update( crc , record[i] );
+        }
+
+        if (crc != record[3]) continue;
+
+        if (newest < 0 || (uint8_t) (record[0] - newest_seq) < 0x80) {
+            newest = record[1] | (record[2] << 8);
+            newest_seq = record[0];
+        }
+
+    }
+
+    if (newest < 0) newest = sim_eeprom[ params_addr() + 3 ] | (sim_eeprom[ params_addr() + 4 ] << 8);
+
+    return newest;
+
+}
+
+// The scenarios. Each sets up the EEPROM, button, and Vcc, and says how long to run.
+
+typedef struct {
+    const char *name;
+    double      seconds;
+    void        (*setup)( void );
+} scenario;
+
+static void boot( void ) {
+
+    program_eeprom( 80 );
+
+}
+
+static void seeks( void ) {
+
+    program_eeprom( 80 );
+
+    for (uint8_t i = 1; i <= 10; i++) {
+        sim_press( i * 10000.0 , 150 );
+    }
+
+}
+
+static void save( void ) {
+
+    program_eeprom( 80 );
+
+    sim_press( 10000 , 150 );           // Seek to the next one...
+    sim_press( 20000 , 2500 );          // ...and save it
+
+}
+
+static void sag( void ) {
+
+    program_eeprom( 80 );
+
+    sim_vcc( 0 , 2600 );
+    sim_vcc( 1800 , 1700 );
+
+}
+
+static void swap( void ) {
+
+    program_eeprom( 80 );
+
+    sim_vcc( 0 , 2400 );
+    sim_vcc( 120 , 1700 );              // Dies...
+    sim_vcc( 600 , 1700 );
+    sim_vcc( 605 , 3000 );              // ...and fresh batteries go in
+
+}
+
+static void reset( void ) {
+
+    program_eeprom( 80 );
+
+    sim_press( 10000 , 150 );           // Seek away...
+    sim_press( 20000 , 5000 );          // ...then ask for a factory reset...
+    sim_press( 26000 , 150 );           // ...and confirm it while the LED asks, which saves into bank B
+
+}
+
+static void noreset( void ) {
+
+    program_eeprom( 80 );
+
+    sim_press( 10000 , 150 );           // Seek away...
+    sim_press( 20000 , 5000 );          // ...then a very long press with no confirm, so nothing changes
+
+}
+
+static void corrupt( void ) {
+
+    program_eeprom( 80 );
+
+    sim_eeprom[ EEPROM_BANK_A + 3 ] ^= 0x01;        // Bank A was cut short by a dying battery, bank B was never written
+
+}
+
+static void ghost( void ) {
+
+    program_eeprom( 80 );
+
+    si4702_stations( ghost_stations , sizeof( ghost_stations ) / sizeof( ghost_stations[0] ) );
+
+    sim_press( 10000 , 150 );           // Stops on the ghost of 103.5, unless RDS says it is the same station
+
+}
+
+static const scenario scenarios[] = {
+    { "boot"  , 3600 , boot  },         // Power up and play for an hour
+    { "seeks" ,  120 , seeks },         // 10 short presses, 10 seconds apart
+    { "save"  ,   60 , save  },         // Seek once, then long press to save
+    { "sag"   , 2400 , sag   },         // Battery runs down to low battery shutdown
+    { "swap"  , 1200 , swap  },         // Battery dies, then fresh ones go in
+    { "reset" ,   60 , reset },         // Seek, then very long press and confirm for a factory reset
+    { "noreset",  60 , noreset },       // Seek, then very long press that is not confirmed
+    { "corrupt",  60 , corrupt },       // Bad bank A at power up, plays the factory params
+    { "ghost" ,   60 , ghost },         // One seek up from a station that is heard on the next channel too
+};
+
+#define SCENARIO_COUNT  (sizeof( scenarios ) / sizeof( scenarios[0] ))
+
+static void run( const scenario *s ) {
+
+    si4702_stations( stations , STATION_COUNT );     // Before setup() so a scenario can have its own
+
+    s->setup();
+
+    alarm( SIM_HANG_S );
+
+    sim_run( s->seconds );
+
+    double awake_ms = (sim_totals.busy_us + sim_totals.idle_us + sim_totals.adc_us) / 1000.0;
+
+    printf( "%-8s %7.0f %9.1f %9.1f %9.1f %8.1f %9.1f %7u %7u %6u %6u %6u %5u %5d %-8s\n" ,
+        s->name ,
+        s->seconds ,
+        sim_totals.busy_us / 1000.0 ,
+        sim_totals.idle_us / 1000.0 ,
+        sim_totals.adc_us / 1000.0 ,
+        awake_ms * 3600.0 / s->seconds ,
+        sim_totals.slow_us / 1000.0 ,
+        (unsigned) sim_totals.wakes ,
+        (unsigned) sim_totals.eeprom_writes ,
+        (unsigned) si4702_totals.bytes ,
+        (unsigned) si4702_totals.transfers ,
+        (unsigned) (si4702_totals.tunes + si4702_totals.seeks) ,
+        (unsigned) si4702_channel() ,
+        saved_channel() ,
+        si4702_playing() ? "playing" : "silent"
+        );
+
+}
+
+int main( int argc , char **argv ) {
+
+    printf( "%-8s %7s %9s %9s %9s %8s %9s %7s %7s %6s %6s %6s %5s %5s %-8s\n" ,
+        "" , "virtual" , "busy" , "idle" , "ADC" , "awake" , "slow" , "" , "EEPROM" , "TWI" , "TWI" , "tunes" , "" , "" , "" );
+    printf( "%-8s %7s %9s %9s %9s %8s %9s %7s %7s %6s %6s %6s %5s %5s %-8s\n" ,
+        "scenario" , "s" , "ms" , "ms" , "ms" , "ms/hr" , "ms" , "wakes" , "writes" , "bytes" , "xfers" , "seeks" , "chan" , "saved" , "audio" );
+
+    int failed = 0;
+
+    for (unsigned i = 0; i < SCENARIO_COUNT; i++) {
+
+        if (argc > 1) {
+
+            int wanted = 0;
+
+            for (int a = 1; a < argc; a++) {
+                if (!strcmp( argv[a] , scenarios[i].name )) wanted = 1;
+            }
+
+            if (!wanted) continue;
+
+        }
+
+        fflush( stdout );
+
+        pid_t child = fork();
+
+        if (child == 0) {
+            run( &scenarios[i] );
+            fflush( stdout );
+            _exit( 0 );
+        }
+
+        int status;
+
+        waitpid( child , &status , 0 );
+
+        if (!WIFEXITED( status ) || WEXITSTATUS( status )) {
+            printf( "%-8s did not finish (%s)\n" , scenarios[i].name , WIFSIGNALED( status ) ? "hung" : "error" );
+            failed = 1;
+        }
+
+    }
+
+    printf( "\nAwake time counts delays and sleeps only, instructions take no time here. See sim/README.md.\n" );
+
+    return failed;
+
+}
@@ -0,0 +1,468 @@
+/***
+
+Fake Si4702 on the TWI pins for the host simulation
+
+Watches SDA and SCL edges like the real chip and answers on address 0010000b. Writes start at register 0x02
+and reads start at 0x0A and wrap from 0x0F to 0x00, both high byte first, just like the datasheet says.
+
+Only what the firmware uses is modelled...
+
+    0x01    Firmware version reads 0 until FMIC_POWERUP_US after ENABLE
+    0x02    ENABLE, DMUTE, SEEK, SEEKUP, SKMODE
+    0x03    TUNE and CHAN
+    0x04    RDS
+    0x05    SEEKTH, BAND, SPACE, VOLUME. A station is found if its RSSI is at least SEEKTH (SNR and impulse are not modelled)
+    0x0A    RDSR, STC, SF/BL, RSSI
+    0x0B    READCHAN
+    0x0C    RDSA, the PI code of the station (0x0D-0x0F read 0)
+
+Tunes and seeks take FMIC_TUNE_US per channel, from the 60ms seek/tune time in the datasheet.
+With RDS on, a station with a PI code has one ready from FMIC_RDS_SYNC_US after the tune or seek finishes.
+
+***/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define FMIC_ADDRESS        0x10
+
+#define FMIC_POWERUP_US     110000.0        // Datasheet max powerup time
+#define FMIC_TUNE_US        60000.0         // Datasheet seek/tune time per channel
+#define FMIC_RDS_SYNC_US    175000.0        // Two RDS groups at 11.4 groups a second
+
+#define FMIC_NOISE_RSSI     3               // RSSI on a channel with no station
+
+si4702_stats si4702_totals;
+
+static const sim_station *station_list;
+static uint8_t            station_count;
+
+static uint16_t reg[16];
+
+static uint8_t  powered;
+static double   powerup_done;
+
+static uint16_t channel;
+static uint8_t  stc;
+static uint8_t  sfbl;
+
+static double   busy_until = -1;            // When the current tune or seek finishes, <0 if not busy
+static double   settled_at;                 // When the last one finished
+static uint16_t seek_result;
+static uint8_t  seek_fail;
+
+// Bus state
+
+typedef enum {
+    BUS_IDLE,                   // Waiting for START
+    BUS_ADDRESS,                // Shifting in the address byte
+    BUS_WRITE,                  // Shifting in data
+    BUS_READ,                   // Shifting out data
+    BUS_IGNORE,                 // Not for us, or master NACKed. Wait for STOP
+} bus_state;
+
+static bus_state state;
+static uint8_t   last_sda = 1;
+static uint8_t   last_scl = 1;
+static uint8_t   bit;                       // Clock count in this byte, 8 is the ACK clock
+static uint8_t   shift;
+static uint8_t   sda_low;
+static uint8_t   read_next;                 // Byte we are sending
+static uint8_t   reg_index;
+static uint8_t   high_half;                 // Next byte is the high byte of reg_index
+static uint8_t   write_high;
+static uint8_t   master_ack;
+static uint8_t   reading;                   // Address byte was a read, switch to BUS_READ after the ACK
+
+void si4702_stations( const sim_station *stations , uint8_t count ) {
+
+    station_list = stations;
+    station_count = count;
+
+}
+
+static uint8_t rssi_of( uint16_t chan ) {
+
+    for (uint8_t i = 0; i < station_count; i++) {
+        if (station_list[i].channel == chan) return station_list[i].rssi;
+    }
+
+    return FMIC_NOISE_RSSI;
+
+}
+
+static uint16_t pi_of( uint16_t chan ) {
+
+    for (uint8_t i = 0; i < station_count; i++) {
+        if (station_list[i].channel == chan) return station_list[i].pi;
+    }
+
+    return 0;
+
+}
+
+// True if there is an RDS group to read, which we just keep saying once there is one
+
+static uint8_t rds_ready( void ) {
+
+    return powered && (reg[4] & 0x1000) && busy_until < 0 && !(reg[2] & 0x0100) && !(reg[3] & 0x8000) && pi_of( channel ) && sim_now_us() >= settled_at + FMIC_RDS_SYNC_US;
+
+}
+
+// Channels in the band from BAND and SPACE in 0x05
+
+static uint16_t band_channels( void ) {
+
+    static const uint16_t range_khz[4] = { 20500 , 32000 , 14000 , 14000 };
+    static const uint16_t space_khz[4] = { 200 , 100 , 50 , 50 };
+
+    return range_khz[ (reg[5] >> 6) & 3 ] / space_khz[ (reg[5] >> 4) & 3 ];
+
+}
+
+static void finish_busy( void ) {
+
+    if (busy_until >= 0 && sim_now_us() >= busy_until) {
+
+        busy_until = -1;
+
+        channel = seek_result;
+        sfbl = seek_fail;
+        stc = 1;
+
+        settled_at = sim_now_us();
+
+    }
+
+}
+
+static void start_tune( uint16_t chan ) {
+
+    si4702_totals.tunes++;
+
+    seek_result = chan;
+    seek_fail = 0;
+    busy_until = sim_now_us() + FMIC_TUNE_US;
+
+}
+
+static void start_seek( void ) {
+
+    si4702_totals.seeks++;
+
+    uint16_t top = band_channels();
+    uint8_t  up = (reg[2] >> 9) & 1;
+    uint8_t  stop_at_limit = (reg[2] >> 10) & 1;
+    uint8_t  seekth = reg[5] >> 8;
+
+    uint16_t chan = channel;
+    uint16_t steps = 0;
+
+    seek_fail = 1;
+
+    while (steps <= top) {
+
+        if (up) {
+            if (chan >= top) {
+                if (stop_at_limit) break;
+                chan = 0;
+            } else {
+                chan++;
+            }
+        } else {
+            if (chan == 0) {
+                if (stop_at_limit) break;
+                chan = top;
+            } else {
+                chan--;
+            }
+        }
+
+        steps++;
+
+        if (chan == channel) break;                     // All the way around
+
+        uint8_t rssi = rssi_of( chan );
+
+        if (rssi > FMIC_NOISE_RSSI && rssi >= seekth) {
+            seek_fail = 0;
+            break;
+        }
+
+    }
+
+    seek_result = chan;
+    busy_until = sim_now_us() + (steps ? steps : 1) * FMIC_TUNE_US;
+
+}
+
+static void abort_busy( void ) {
+
+    if (busy_until >= 0) {              // Aborted, leave it where it got to (close enough)
+        busy_until = -1;
+        channel = seek_result;
+        settled_at = sim_now_us();
+    }
+
+    stc = 0;
+    sfbl = 0;
+
+}
+
+static void write_register( uint8_t r , uint16_t value ) {
+
+    uint16_t old = reg[r];
+
+    reg[r] = value;
+
+    if (r == 2) {
+
+        if ((value & 0x0001) && !(old & 0x0001)) {          // ENABLE
+            powered = 1;
+            powerup_done = sim_now_us() + FMIC_POWERUP_US;
+        }
+
+        if ((value & 0x0100) && !(old & 0x0100) && powered) start_seek();
+        if (!(value & 0x0100) && (old & 0x0100)) abort_busy();
+
+    } else if (r == 3) {
+
+        if ((value & 0x8000) && !(old & 0x8000) && powered) start_tune( value & 0x03ff );
+        if (!(value & 0x8000) && (old & 0x8000)) abort_busy();
+
+    }
+
+}
+
+static uint16_t read_register( uint8_t r ) {
+
+    finish_busy();
+
+    switch (r) {
+
+        case 0x00:
+            return 0x1242;              // Part number and manufacturer
+
+        case 0x01:
+            return (powered && sim_now_us() >= powerup_done) ? 0x1253 : 0x1240;      // Firmware version in bits 5:0
+
+        case 0x0a:
+            return (rds_ready() ? 0x8000 : 0) | (stc ? 0x4000 : 0) | (sfbl ? 0x2000 : 0) | (powered ? rssi_of( channel ) : 0);
+
+        case 0x0b:
+            return channel & 0x03ff;
+
+        case 0x0c:
+            return rds_ready() ? pi_of( channel ) : 0;
+
+        case 0x0d: case 0x0e: case 0x0f:
+            return 0;                   // Only the PI is modelled
+
+        default:
+            return reg[r];
+
+    }
+
+}
+
+static void chip_reset( void ) {
+
+    memset( reg , 0 , sizeof( reg ) );
+
+    powered = 0;
+    channel = 0;
+    stc = 0;
+    sfbl = 0;
+    busy_until = -1;
+    state = BUS_IDLE;
+    sda_low = 0;
+
+}
+
+// Byte we are about to send
+
+static uint8_t tx_byte( void ) {
+
+    uint16_t value = read_register( reg_index );
+
+    return high_half ? value >> 8 : value & 0xff;
+
+}
+
+static void next_half( void ) {
+
+    if (high_half) {
+        high_half = 0;
+    } else {
+        high_half = 1;
+        reg_index = (reg_index + 1) & 0x0f;
+    }
+
+}
+
+static void received( uint8_t b ) {
+
+    si4702_totals.bytes++;
+
+    if (state == BUS_ADDRESS) {
+
+        if ((b >> 1) != FMIC_ADDRESS) {
+            state = BUS_IGNORE;
+            return;
+        }
+
+        high_half = 1;
+
+        if (b & 1) {
+            reading = 1;
+            reg_index = 0x0a;
+        } else {
+            state = BUS_WRITE;
+            reg_index = 0x02;
+        }
+
+        sda_low = 1;            // ACK
+        return;
+
+    }
+
+    // BUS_WRITE. The register only changes once both bytes are in.
+
+    if (high_half) {
+        write_high = b;
+    } else {
+        write_register( reg_index , (write_high << 8) | b );
+    }
+
+    next_half();
+
+    sda_low = 1;                // ACK
+
+}
+
+uint8_t si4702_bus( uint8_t sda , uint8_t scl , uint8_t reset ) {
+
+    if (reset) {
+
+        if (powered || state != BUS_IDLE) chip_reset();
+
+        last_sda = sda;
+        last_scl = scl;
+
+        return 0;
+
+    }
+
+    // bit counts rising SCL edges in the current byte, so 8 data bits and then the ACK clock.
+    // Falling edges are where whoever is sending changes SDA. A data change in the same sample as SCL
+    // falling is taken to be after it, which is what the master meant.
+
+    uint8_t scl_fell = last_scl && !scl;
+    uint8_t scl_rose = !last_scl && scl;
+
+    if (scl_fell) {
+
+        if (state == BUS_ADDRESS || state == BUS_WRITE) {
+
+            if (bit == 8) {
+
+                received( shift );          // Sets sda_low for the ACK if it is for us
+
+            } else if (bit == 9) {
+
+                bit = 0;
+                shift = 0;
+                sda_low = 0;
+
+                if (reading) {              // Address said read, so start sending the first byte
+                    reading = 0;
+                    state = BUS_READ;
+                    read_next = tx_byte();
+                    sda_low = !(read_next & 0x80);
+                }
+
+            }
+
+        } else if (state == BUS_READ) {
+
+            if (bit < 8) {
+
+                sda_low = !(read_next & (0x80 >> bit));
+
+            } else if (bit == 8) {
+
+                sda_low = 0;                // Let the master ACK
+                si4702_totals.bytes++;
+                next_half();
+
+            } else {
+
+                bit = 0;
+
+                if (master_ack) {
+                    read_next = tx_byte();
+                    sda_low = !(read_next & 0x80);
+                } else {
+                    state = BUS_IGNORE;     // NACK means that was the last one
+                }
+
+            }
+
+        }
+
+    }
+
+    uint8_t line = sda && !sda_low;
+
+    if (scl && !scl_rose && last_sda != line) {
+
+        // SDA changed while SCL high is START or STOP
+
+        if (!line) {
+            state = BUS_ADDRESS;
+            bit = 0;
+            shift = 0;
+            reading = 0;
+            si4702_totals.transfers++;
+        } else {
+            state = BUS_IDLE;
+        }
+
+        sda_low = 0;
+
+    }
+
+    if (scl_rose) {
+
+        if ((state == BUS_ADDRESS || state == BUS_WRITE) && bit < 8) {
+            shift = (shift << 1) | (line ? 1 : 0);
+        } else if (state == BUS_READ && bit == 8) {
+            master_ack = !line;
+        }
+
+        if (state != BUS_IDLE && state != BUS_IGNORE) bit++;
+
+    }
+
+    last_sda = sda && !sda_low;
+    last_scl = scl;
+
+    return sda_low;
+
+}
+
+uint16_t si4702_channel( void ) {
+
+    finish_busy();
+
+    return channel;
+
+}
+
+uint8_t si4702_playing( void ) {
+
+    return powered && (reg[2] & 0x4000) && (reg[2] & 0x0001) && (reg[5] & 0x000f);
+
+}
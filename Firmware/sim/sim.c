@@ -0,0 +1,568 @@
+/***
+
+Virtual clock, sleep, interrupts, ADC, EEPROM, and pins for the host simulation
+
+Time moves forward one event at a time (a button edge, a WDT timeout, a Timer0 tick, a finished ADC conversion)
+so everything happens in the same order it would on the chip. The TWI pins are looked at every time the
+firmware delays or sleeps, which the bitbang TWI does between every edge.
+
+Peripherals are only modelled as far as the firmware uses them...
+
+    WDT         Interrupt mode only, runs whenever WDIE is set
+    Timer0      Counting and compare match in CTC mode, overflow in normal mode. Stops in power down and ADC sleep
+    ADC         Conversions take 25 ADC clocks for the first after enable and 13 after. Always reads the bandgap
+    PRR         Timer0 and the ADC stop while their bits are set
+    PCINT       Button on PB3 only
+    CLKPR       The 8MHz RC divided by 2^CLKPS. Starts at /8 like the CKDIV8 fuse. Delays, Timer0, and the ADC follow it
+    EEPROM      The avr-libc functions finish instantly. Writes started with EECR take EEPROM_WRITE_US and raise EE_RDY
+                after, which can not wake us from power down
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+
+#include "sim.h"
+
+#include "../profile.h"
+
+#include "../VccProg.h"
+
+// The registers
+
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t GIMSK, GIFR, PCMSK;
+volatile uint8_t MCUCR, MCUSR, SREG;
+volatile uint8_t WDTCR, PRR;
+volatile uint8_t CLKPR = 3;                     // CKDIV8 fuse
+volatile uint8_t ADMUX, ADCSRA, ADCSRB;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+volatile uint8_t TIMSK, TIFR, GTCCR;
+volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C;
+volatile uint8_t USIDR, USIBR, USISR, USICR;
+volatile uint8_t EECR, EEDR;
+
+volatile uint16_t ADC;
+volatile uint16_t EEAR;
+
+volatile uint8_t sim_interrupts;
+volatile uint8_t sim_sleep_mode;
+
+uint8_t sim_eeprom[ SIM_EEPROM_SIZE ];
+
+sim_stats sim_totals;
+
+// The firmware ISRs. Weak because not every build has all of them.
+
+extern void WDT_vect(void)        __attribute__((weak));
+extern void PCINT0_vect(void)     __attribute__((weak));
+extern void TIM0_COMPA_vect(void) __attribute__((weak));
+extern void TIM0_OVF_vect(void)   __attribute__((weak));
+extern void ADC_vect(void)        __attribute__((weak));
+extern void EE_RDY_vect(void)     __attribute__((weak));
+
+#define BUTTON_BIT      PB3
+#define SDA_BIT         PB0
+#define SCL_BIT         PB2
+#define RESET_BIT       PB1
+
+#define NEVER           (1e300)
+
+#define EEPROM_WRITE_US (3400.0)        // Datasheet typical erase and write time
+
+// What the CPU is doing while time passes
+
+typedef enum {
+    STATE_BUSY,
+    STATE_IDLE,
+    STATE_ADC,
+    STATE_POWERDOWN,
+} sim_state;
+
+static double now_us;
+static double end_us;
+
+static jmp_buf sim_done;
+
+// Button edges, in time order
+
+#define SIM_MAX_EDGES   64
+
+static double  edge_at[ SIM_MAX_EDGES ];
+static uint8_t edge_down[ SIM_MAX_EDGES ];
+static uint8_t edge_count;
+static uint8_t edge_next;
+
+static uint8_t button_down;
+
+// Vcc is piecewise linear between these points
+
+#define SIM_MAX_VCC     16
+
+static double   vcc_at_us[ SIM_MAX_VCC ] = { 0 };
+static uint16_t vcc_mv[ SIM_MAX_VCC ]    = { 3000 };
+static uint8_t  vcc_count = 1;
+
+// Pending interrupts. Only set when the interrupt is enabled at the time, so a write-1-to-clear in the firmware
+// (which just stores here) can never make a stale one fire.
+
+static uint8_t wdt_pending, pcint_pending, t0_match_pending, t0_ovf_pending, adc_pending;
+
+static double wdt_start = -1;                   // When the current WDT period started, <0 if WDIE is off
+
+static double t0_next_tick = -1;                // <0 if Timer0 is not running
+
+static double  adc_done_at = -1;                // <0 if no conversion running
+static uint8_t adc_was_enabled;
+static uint8_t adc_first;
+
+static double ee_done_at = -1;                  // <0 if no EECR write running
+
+static uint8_t sda_low_by_chip;
+
+void sim_press( double at_ms , double hold_ms ) {
+
+    if (edge_count + 2 > SIM_MAX_EDGES) {
+        fprintf( stderr , "sim: too many button presses\n" );
+        exit( 2 );
+    }
+
+    edge_at[ edge_count ] = at_ms * 1000.0;
+    edge_down[ edge_count++ ] = 1;
+
+    edge_at[ edge_count ] = (at_ms + hold_ms) * 1000.0;
+    edge_down[ edge_count++ ] = 0;
+
+}
+
+void sim_vcc( double at_s , uint16_t mv ) {
+
+    if (vcc_count >= SIM_MAX_VCC) {
+        fprintf( stderr , "sim: too many Vcc points\n" );
+        exit( 2 );
+    }
+
+    vcc_at_us[ vcc_count ] = at_s * 1e6;
+    vcc_mv[ vcc_count++ ] = mv;
+
+}
+
+double sim_now_us( void ) {
+    return now_us;
+}
+
+static double vcc_now( void ) {
+
+    for (uint8_t i = 1; i < vcc_count; i++) {
+
+        if (now_us < vcc_at_us[i]) {
+
+            double f = (now_us - vcc_at_us[i-1]) / (vcc_at_us[i] - vcc_at_us[i-1]);
+
+            return vcc_mv[i-1] + f * ((double) vcc_mv[i] - vcc_mv[i-1]);
+
+        }
+
+    }
+
+    return vcc_mv[ vcc_count - 1 ];
+
+}
+
+// WDT period from the WDP bits, in us
+
+static double wdt_period( void ) {
+
+    uint8_t wdp = (WDTCR & (_BV( WDP2 ) | _BV( WDP1 ) | _BV( WDP0 ))) | ((WDTCR & _BV( WDP3 )) ? 8 : 0);
+
+    return 16000.0 * (1 << wdp);
+
+}
+
+static const uint16_t t0_prescale[8] = { 0 , 1 , 8 , 64 , 256 , 1024 , 0 , 0 };          // 6 and 7 are external clock
+
+// One CPU clock right now, in us
+
+static double clock_us( void ) {
+    return (1 << (CLKPR & 0x0f)) / 8.0;
+}
+
+static double t0_tick_us( void ) {
+    return t0_prescale[ TCCR0B & 0x07 ] * clock_us();
+}
+
+static double adc_clock_us( void ) {
+
+    uint8_t adps = ADCSRA & 0x07;
+
+    return (adps ? (1 << adps) : 2) * clock_us();
+
+}
+
+// Pins, seen by the firmware in PINB. Both TWI lines are open collector with the pull-up (or a released pin) reading high.
+
+static void update_pins( void ) {
+
+    uint8_t sda = !( (DDRB & _BV( SDA_BIT )) && !(PORTB & _BV( SDA_BIT )) ) && !sda_low_by_chip;
+    uint8_t scl = !( (DDRB & _BV( SCL_BIT )) && !(PORTB & _BV( SCL_BIT )) );
+
+    uint8_t pins = PORTB & ~( _BV( SDA_BIT ) | _BV( SCL_BIT ) | _BV( BUTTON_BIT ) );
+
+    if (sda) pins |= _BV( SDA_BIT );
+    if (scl) pins |= _BV( SCL_BIT );
+
+    if (!button_down && (PORTB & _BV( BUTTON_BIT ))) pins |= _BV( BUTTON_BIT );          // Pulled up unless pressed
+
+    PINB = pins;
+
+}
+
+static void sample_bus( void ) {
+
+    uint8_t sda   = !( (DDRB & _BV( SDA_BIT )) && !(PORTB & _BV( SDA_BIT )) );          // What the master is doing
+    uint8_t scl   = !( (DDRB & _BV( SCL_BIT )) && !(PORTB & _BV( SCL_BIT )) );
+    uint8_t reset = !( (DDRB & _BV( RESET_BIT )) && (PORTB & _BV( RESET_BIT )) );       // FMIC_RESET is active low
+
+    sda_low_by_chip = si4702_bus( sda , scl , reset );
+
+    update_pins();
+
+}
+
+// Start or stop things that depend on the registers the firmware just set
+
+static void check_registers( sim_state state ) {
+
+    if (WDTCR & _BV( WDIE )) {
+        if (wdt_start < 0) wdt_start = now_us;
+    } else {
+        wdt_start = -1;
+    }
+
+    uint8_t t0_running = (TCCR0B & 0x07) && t0_prescale[ TCCR0B & 0x07 ] && !(PRR & _BV( PRTIM0 )) && state != STATE_POWERDOWN && state != STATE_ADC;
+
+    if (!t0_running) {
+        t0_next_tick = -1;
+    } else if (t0_next_tick < 0) {
+        t0_next_tick = now_us + t0_tick_us();
+    }
+
+    uint8_t adc_enabled = (ADCSRA & _BV( ADEN )) && !(PRR & _BV( PRADC ));
+
+    if (adc_enabled && !adc_was_enabled) adc_first = 1;
+
+    adc_was_enabled = adc_enabled;
+
+    if (!adc_enabled) {
+        adc_done_at = -1;
+    } else if ((ADCSRA & _BV( ADSC )) && adc_done_at < 0) {
+        adc_done_at = now_us + adc_clock_us() * (adc_first ? 25 : 13);
+        adc_first = 0;
+    }
+
+    if ((EECR & _BV( EEPE )) && ee_done_at < 0) {
+
+        if ((uintptr_t) EEAR >= SIM_EEPROM_SIZE) {
+            fprintf( stderr , "sim: EEPROM write past the end at 0x%x\n" , (unsigned) EEAR );
+            exit( 3 );
+        }
+
+        ee_done_at = now_us + EEPROM_WRITE_US;
+
+    }
+
+}
+
+static double next_event( void ) {
+
+    double next = end_us;
+
+    if (edge_next < edge_count && edge_at[ edge_next ] < next) next = edge_at[ edge_next ];
+
+    if (wdt_start >= 0 && wdt_start + wdt_period() < next) next = wdt_start + wdt_period();
+
+    if (t0_next_tick >= 0 && t0_next_tick < next) next = t0_next_tick;
+
+    if (adc_done_at >= 0 && adc_done_at < next) next = adc_done_at;
+
+    if (ee_done_at >= 0 && ee_done_at < next) next = ee_done_at;
+
+    return next;
+
+}
+
+static void account( sim_state state , double us ) {
+
+    if (state != STATE_POWERDOWN && clock_us() * F_CPU > 1e6) sim_totals.slow_us += us;
+
+    switch (state) {
+        case STATE_BUSY:      sim_totals.busy_us += us;      break;
+        case STATE_IDLE:      sim_totals.idle_us += us;      break;
+        case STATE_ADC:       sim_totals.adc_us += us;       break;
+        case STATE_POWERDOWN: sim_totals.powerdown_us += us; break;
+    }
+
+}
+
+// Move time to the next event (or until) and handle it. Ends the run if we get to end_us.
+
+static void step( sim_state state , double until ) {
+
+    check_registers( state );
+
+    double next = next_event();
+
+    if (until < next) next = until;
+
+    account( state , next - now_us );
+
+    now_us = next;
+
+    if (now_us >= end_us) longjmp( sim_done , 1 );
+
+    if (edge_next < edge_count && edge_at[ edge_next ] <= now_us) {
+
+        button_down = edge_down[ edge_next++ ];
+
+        if (PCMSK & _BV( PCINT3 )) pcint_pending = 1;
+
+    }
+
+    if (wdt_start >= 0 && wdt_start + wdt_period() <= now_us) {
+
+        wdt_start += wdt_period();
+
+        wdt_pending = 1;
+
+    }
+
+    if (t0_next_tick >= 0 && t0_next_tick <= now_us) {
+
+        t0_next_tick += t0_tick_us();
+
+        if ((TCCR0A & _BV( WGM01 )) && TCNT0 == OCR0A) {          // CTC
+
+            TCNT0 = 0;
+
+            if (TIMSK & _BV( OCIE0A )) t0_match_pending = 1;
+
+        } else if (++TCNT0 == 0) {
+
+            if (TIMSK & _BV( TOIE0 )) t0_ovf_pending = 1;
+
+        }
+
+    }
+
+    if (adc_done_at >= 0 && adc_done_at <= now_us) {
+
+        adc_done_at = -1;
+
+        double adc = (1100.0 * 1023.0) / vcc_now();          // Bandgap against Vcc
+
+        ADC = adc > 1023 ? 1023 : (uint16_t) (adc + 0.5);
+
+        ADCSRA &= ~_BV( ADSC );
+
+        if (ADCSRA & _BV( ADIE )) adc_pending = 1;
+
+    }
+
+    if (ee_done_at >= 0 && ee_done_at <= now_us) {
+
+        ee_done_at = -1;
+
+        sim_eeprom[ EEAR ] = EEDR;
+
+        sim_totals.eeprom_writes++;
+
+        EECR &= ~( _BV( EEPE ) | _BV( EEMPE ) );
+
+    }
+
+    update_pins();
+
+}
+
+static void sim_busy( double us ) {
+
+    sample_bus();
+
+    double until = now_us + us;
+
+    while (now_us < until) {
+        step( STATE_BUSY , until );
+    }
+
+    sample_bus();
+
+}
+
+// _delay_*() are worked out for F_CPU, so they take longer if the clock has been slowed down
+
+void sim_delay( double us ) {
+
+    sim_busy( us * clock_us() * (F_CPU / 1e6) );
+
+}
+
+// Run one pending interrupt if there is one that is enabled. Returns true if it did.
+
+static uint8_t service( sim_state state ) {
+
+    uint8_t ee_ready = !(EECR & _BV( EEPE )) && state != STATE_POWERDOWN;          // EE_RDY is a level, not an event
+
+#define SERVICE(pending, enabled, vector) if ((pending) && (enabled)) { pending = 0; if (vector) vector(); return 1; }
+
+    SERVICE( pcint_pending    , GIMSK & _BV( PCIE )    , PCINT0_vect );
+    SERVICE( wdt_pending      , WDTCR & _BV( WDIE )    , WDT_vect );
+    SERVICE( t0_match_pending , TIMSK & _BV( OCIE0A )  , TIM0_COMPA_vect );
+    SERVICE( t0_ovf_pending   , TIMSK & _BV( TOIE0 )   , TIM0_OVF_vect );
+    SERVICE( adc_pending      , ADCSRA & _BV( ADIE )   , ADC_vect );
+    SERVICE( ee_ready         , EECR & _BV( EERIE )    , EE_RDY_vect );
+
+    return 0;
+
+}
+
+void sim_sleep( void ) {
+
+    if (!(MCUCR & _BV( SE ))) return;         // SLEEP does nothing without SE
+
+    if (!sim_interrupts) {
+        fprintf( stderr , "sim: sleep with interrupts off at %.3fs would never wake\n" , now_us / 1e6 );
+        exit( 3 );
+    }
+
+    sim_state state = sim_sleep_mode == SLEEP_MODE_IDLE ? STATE_IDLE : sim_sleep_mode == SLEEP_MODE_ADC ? STATE_ADC : STATE_POWERDOWN;
+
+    sample_bus();
+
+    while (!service( state )) {
+        step( state , NEVER );
+    }
+
+    sim_totals.wakes++;
+
+}
+
+void sim_wdt_reset( void ) {
+
+    if (wdt_start >= 0) wdt_start = now_us;
+
+}
+
+// EEPROM
+
+static void eeprom_check( const void *addr , size_t n ) {
+
+    if ((uintptr_t) addr + n > SIM_EEPROM_SIZE) {
+        fprintf( stderr , "sim: EEPROM access past the end at 0x%lx\n" , (unsigned long) (uintptr_t) addr );
+        exit( 3 );
+    }
+
+}
+
+uint8_t eeprom_read_byte( const uint8_t *addr ) {
+
+    eeprom_check( addr , 1 );
+
+    return sim_eeprom[ (uintptr_t) addr ];
+
+}
+
+uint16_t eeprom_read_word( const uint16_t *addr ) {
+
+    eeprom_check( addr , 2 );
+
+    return sim_eeprom[ (uintptr_t) addr ] | (sim_eeprom[ (uintptr_t) addr + 1 ] << 8);
+
+}
+
+void eeprom_read_block( void *dst , const void *src , size_t n ) {
+
+    eeprom_check( src , n );
+
+    memcpy( dst , &sim_eeprom[ (uintptr_t) src ] , n );
+
+}
+
+void eeprom_write_byte( uint8_t *addr , uint8_t value ) {
+
+    eeprom_check( addr , 1 );
+
+    sim_eeprom[ (uintptr_t) addr ] = value;
+
+    sim_totals.eeprom_writes++;
+
+}
+
+void eeprom_write_word( uint16_t *addr , uint16_t value ) {
+
+    eeprom_write_byte( (uint8_t *) addr , value & 0xff );
+    eeprom_write_byte( (uint8_t *) addr + 1 , value >> 8 );
+
+}
+
+void eeprom_write_block( const void *src , void *dst , size_t n ) {
+
+    for (size_t i = 0; i < n; i++) {
+        eeprom_write_byte( (uint8_t *) dst + i , ((const uint8_t *) src)[i] );
+    }
+
+}
+
+void eeprom_update_byte( uint8_t *addr , uint8_t value ) {
+
+    if (eeprom_read_byte( addr ) != value) eeprom_write_byte( addr , value );
+
+}
+
+void eeprom_update_word( uint16_t *addr , uint16_t value ) {
+
+    eeprom_update_byte( (uint8_t *) addr , value & 0xff );
+    eeprom_update_byte( (uint8_t *) addr + 1 , value >> 8 );
+
+}
+
+void eeprom_update_block( const void *src , void *dst , size_t n ) {
+
+    for (size_t i = 0; i < n; i++) {
+        eeprom_update_byte( (uint8_t *) dst + i , ((const uint8_t *) src)[i] );
+    }
+
+}
+
+// Only called if Vcc is over VCCPROG_MV at power up. Receiving needs a busy wait on the ADC that the
+// simulator can not see, so the jig is not simulated.
+
+uint8_t vccprog_receive( vccprog_frame *frame ) {
+
+    (void) frame;
+
+    fprintf( stderr , "sim: programming mode is not simulated\n" );
+    exit( 3 );
+
+}
+
+// The firmware's main(), renamed by the Makefile so it does not clash with ours
+
+extern int firmware_main( void );
+
+void sim_run( double seconds ) {
+
+    end_us = seconds * 1e6;
+
+    update_pins();
+
+    if (!setjmp( sim_done )) {
+        firmware_main();
+    }
+
+}
@@ -0,0 +1,83 @@
+/***
+
+Host simulation of the TPR firmware
+
+The firmware sources are compiled for the host against the stand-in AVR headers in this directory.
+Virtual time only moves in _delay_*() (busy, CPU awake) and sleep_cpu() (asleep in whatever mode was set),
+which is where the firmware spends all of its time anyway. Code in between takes no time here, so the awake
+numbers are a floor - they count delays and idle waits, not instructions.
+
+See README.md for how to run it.
+
+***/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+// Set by the stand-in sei()/cli()/set_sleep_mode()
+
+extern volatile uint8_t sim_interrupts;
+extern volatile uint8_t sim_sleep_mode;
+
+// Called by the stand-in headers
+
+void sim_delay( double us );
+void sim_sleep( void );
+void sim_wdt_reset( void );
+
+// Virtual time since power on
+
+double sim_now_us( void );
+
+// Scenario setup. Times are from power on. 
+
+#define SIM_EEPROM_SIZE     (E2END + 1)
+
+extern uint8_t sim_eeprom[];
+
+void sim_press( double at_ms , double hold_ms );            // Press the button at at_ms for hold_ms
+void sim_vcc( double at_s , uint16_t mv );                  // Vcc ramps linearly to mv at at_s, starts at 3000mV
+
+// Results
+
+typedef struct {
+    double   busy_us;               // CPU running in _delay_*()
+    double   idle_us;               // Idle sleep
+    double   adc_us;                // ADC noise reduction sleep
+    double   powerdown_us;          // Power down sleep
+    double   slow_us;               // Part of busy, idle, and ADC that was below F_CPU (CLOCK=dynamic)
+    uint32_t wakes;                 // Times sleep_cpu() returned
+    uint32_t eeprom_writes;         // Bytes actually written to EEPROM (update_*() skips unchanged bytes)
+} sim_stats;
+
+extern sim_stats sim_totals;
+
+// Run the firmware until at_s, then return. Only call once per process since the firmware has static state.
+
+void sim_run( double seconds );
+
+// Fake Si4702 on the TWI pins (si4702.c)
+
+typedef struct {
+    uint16_t channel;
+    uint8_t  rssi;
+    uint16_t pi;                    // RDS PI code, 0 for a station with no RDS
+} sim_station;
+
+typedef struct {
+    uint32_t bytes;                 // Bytes on the bus including address bytes
+    uint32_t transfers;             // STARTs
+    uint32_t tunes;
+    uint32_t seeks;
+} si4702_stats;
+
+extern si4702_stats si4702_totals;
+
+void     si4702_stations( const sim_station *stations , uint8_t count );
+uint8_t  si4702_bus( uint8_t sda , uint8_t scl , uint8_t reset );      // Returns true if the chip is pulling SDA low
+uint16_t si4702_channel( void );
+uint8_t  si4702_playing( void );                                     // Out of reset, powered up, and unmuted
+
+#endif
@@ -0,0 +1,14 @@
+/***
+
+Host simulation stand-in for <util/atomic.h>. Nothing preempts the firmware here, so blocks just run.
+
+***/
+
+#ifndef SIM_UTIL_ATOMIC_H
+#define SIM_UTIL_ATOMIC_H
+
+#define ATOMIC_BLOCK(type)      for (uint8_t sim_atomic_once = 1; sim_atomic_once; sim_atomic_once = 0)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#endif
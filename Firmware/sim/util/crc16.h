@@ -0,0 +1,43 @@
+/***
+
+Host simulation stand-in for <util/crc16.h>. These are the C equivalents from the avr-libc docs.
+
+***/
+
+#ifndef SIM_UTIL_CRC16_H
+#define SIM_UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update( uint16_t crc , uint8_t a ) {
+    
+    crc ^= a;
+    
+    for (uint8_t i = 0; i < 8; ++i) {
+        if (crc & 1) {
+            crc = (crc >> 1) ^ 0xA001;
+        } else {
+            crc = (crc >> 1);
+        }
+    }
+    
+    return crc;
+}
+
+static inline uint8_t _crc8_ccitt_update( uint8_t inCrc , uint8_t inData ) {
+    
+    uint8_t data = inCrc ^ inData;
+    
+    for (uint8_t i = 0; i < 8; i++) {
+        if ((data & 0x80) != 0) {
+            data <<= 1;
+            data ^= 0x07;
+        } else {
+            data <<= 1;
+        }
+    }
+    
+    return data;
+}
+
+#endif
@@ -0,0 +1,17 @@
+/***
+
+Host simulation stand-in for <util/delay.h>
+
+Busy waits just move the virtual clock forward with the CPU awake, longer if the clock is slowed down.
+
+***/
+
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+
+#include "../sim.h"
+
+#define _delay_us(us)   sim_delay( (double) (us) )
+#define _delay_ms(ms)   sim_delay( (double) (ms) * 1000.0 )
+
+#endif
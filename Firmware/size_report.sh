@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# Flash size report for the TPR firmware, run by `make size` and `make size_baseline`
+#
+#     size_report.sh elf baseline growth flash [update]
+#
+# Prints the section sizes and every function and object by size from avr-size and avr-nm, next to
+# the sizes in the baseline file and the change from it. Fails if the image uses more flash than the
+# part has, or more than `growth` bytes more than the baseline. With `update` it writes the baseline
+# instead, so check that in whenever a change is meant to cost space.
+#
+# The baseline is just this report in a stable form, one "kind name bytes" per line, so a diff of it
+# in a commit shows exactly what moved.
+#
+
+AVR_NM=${AVR_NM:-avr-nm}
+AVR_SIZE=${AVR_SIZE:-avr-size}
+
+elf=$1
+baseline=$2
+growth=$3
+flash=$4
+
+current=`mktemp -t prsize.XXXXXX` || exit 1
+trap 'rm -f "$current"' EXIT
+
+# Sections, then flash (.text plus the .data initializers that are stored there), then symbols by size.
+# Symbols with no size (labels, linker symbols) are left out by --size-sort.
+
+{
+	$AVR_SIZE -A "$elf" | awk '
+		$1 == ".text" || $1 == ".data" || $1 == ".bss" { print "section", $1, $2 ; size[$1] = $2 }
+		END { print "flash", "total", size[".text"] + size[".data"] }
+	'
+	$AVR_NM --size-sort -S -t d "$elf" | awk '
+		$3 ~ /^[tTwW]$/ { print "function", $4, $2 + 0 }
+		$3 ~ /^[bBdDrR]$/ { print "object", $4, $2 + 0 }
+	' | sort -k3,3nr -k2,2
+} > "$current"
+
+if ! grep -q '^section .text ' "$current"; then
+	echo "Could not get sizes from $AVR_SIZE and $AVR_NM"
+	exit 1
+fi
+
+if [ "$5" = "update" ]; then
+	cp "$current" "$baseline" || exit 1
+	echo "Wrote $baseline"
+	exit 0
+fi
+
+# No baseline is a failure, not a pass, or the growth check could never catch anything.
+
+if [ ! -f "$baseline" ]; then
+	echo "FAIL: no $baseline to compare with. Make one from the default build with 'make size_baseline' and check it in."
+	exit 1
+fi
+
+# First file is the baseline, second is now. Anything in only one of them shows as 0 in the other.
+
+awk -v growth="$growth" -v flash="$flash" '
+
+	FILENAME == ARGV[1] { was[$1 " " $2] = $3 ; next }           # NR == FNR would not work for an empty baseline file
+
+	{
+		key = $1 " " $2
+		now[key] = $3
+		order[++count] = key
+	}
+
+	END {
+
+		based = ("flash total" in was)          # Before anything below reads was[] and makes it exist
+
+		for (key in was) if (!(key in now)) order[++count] = key
+
+		printf "%-9s %-32s %6s %6s %6s\n", "", "", "base", "now", "change"
+
+		for (i = 1; i <= count; i++) {
+
+			key = order[i]
+			split( key , part , " " )
+
+			delta = now[key] - was[key]
+
+			printf "%-9s %-32s %6d %6d %+6d\n", part[1], part[2], was[key], now[key], delta
+
+		}
+
+		total = now["flash total"]
+		grew  = total - was["flash total"]
+
+		printf "\nFlash %d of %d bytes, %d free.\n", total, flash, flash - total
+
+		if (total > flash) {
+			print "FAIL: image does not fit"
+			exit 1
+		}
+
+		if (!based) {
+			print "FAIL: baseline has no flash total, make it again with make size_baseline"
+			exit 1
+		}
+
+		if (grew > growth) {
+			printf "FAIL: flash grew %d bytes, more than the %d allowed. If that is expected, make size_baseline and check it in.\n", grew, growth
+			exit 1
+		}
+
+	}
+
+' "$baseline" "$current"
@@ -1,14 +1,61 @@
 
 #include <util/crc16.h>
 
+// Uncomment if the TPR Vcc is also wired to this analog pin. Then we measure how fast the
+// board recovers from a dip at the start of each version 2 frame and pick T to match.
+//#define SENSE_PIN A3
+
+
+// Each slot powers one TPR from 3 pins on the same port so they all switch at the same time.
+// Slot 0 is the original A0-A2. PD0 and PD1 are the serial port so we leave them alone.
+
+#define SLOTS 5
+
+volatile uint8_t * const slotPort[SLOTS] = { &PORTC     , &PORTD     , &PORTD     , &PORTB     , &PORTB      };
+volatile uint8_t * const slotDDR[SLOTS]  = { &DDRC      , &DDRD      , &DDRD      , &DDRB      , &DDRB       };
+const uint8_t            slotMask[SLOTS] = { 0b00000111 , 0b00011100 , 0b11100000 , 0b00000111 , 0b00111000 };
+
+// Which pins to dip right now. All the slots in here get exactly the same waveform.
+
+uint8_t dipC = 0b00000111;
+uint8_t dipD = 0;
+uint8_t dipB = 0;
+
+void selectSlots( uint8_t slots ) {
+
+  dipC = dipD = dipB = 0;
+
+  for( int i=0 ; i<SLOTS ; i++ ) {
+    if (slots & (1<<i)) {
+      if (slotPort[i]==&PORTC) dipC |= slotMask[i];
+      if (slotPort[i]==&PORTD) dipD |= slotMask[i];
+      if (slotPort[i]==&PORTB) dipB |= slotMask[i];
+    }
+  }
+
+}
+
+inline void linesLow() {
+  PORTC &= ~dipC;
+  PORTD &= ~dipD;
+  PORTB &= ~dipB;
+}
+
+inline void linesHigh() {
+  PORTC |= dipC;
+  PORTD |= dipD;
+  PORTB |= dipB;
+}
 
 
 void setup() {
 
-// Pins A0, A1, and A2 used to power the attached TPR
+// Drive all slot pins high to power the attached TPRs
   
-  DDRC  = 0b00000111;       // Output
-  PORTC = 0b00000111;       // Drive output pins high
+  for( int i=0 ; i<SLOTS ; i++ ) {
+    *slotPort[i] |= slotMask[i];      // Drive output pins high
+    *slotDDR[i]  |= slotMask[i];      // Output
+  }
   
   Serial.begin(9600);
   while (! Serial); // Wait until Serial is ready 
@@ -18,8 +65,8 @@ void setup() {
 
 /**
  * 
- *  TPR EEPROM programming protocol
- *  ===============================
+ *  TPR EEPROM programming protocol version 1
+ *  =========================================
  *  
  *  TPR knows it is in programming mode when it sees 5V on Vcc. 
  *  
@@ -39,20 +86,28 @@ void setup() {
  *  
  *  A full pulse cycle takes about 10ms to RX becuase of the recovery time of the 10uF cap. 
  *  This speed reqires using 2 IO pins to drive enough current. Make sure you
- *  switch both pins simultainiously using PORT assignmnets!
+ *  switch both pins simultainiously using PORT assignmnets! (We use 3 per slot, see slotMask.)
  *  
  *  When a sync is seen, TPR waits 7.5ms and starts looking for a 2nd pulse. 
  *  If a second pulse is seen in the next 5ms, then a 1 is recieved, otherwise a 0.
  *  
  *  Then we start looking for next sync pulse, which shoudl come in about 2.5ms.
  * 
- *  8 bits to a byte. TODO: Add parity?
+ *  8 bits to a byte, MSB first. TODO: Add parity?
  *  
  *  No break neede between bytes.
  *  
- *  Variable length frames have 50ms ide between them.
+ *  Frames have 50ms idle between them. Each frame is...
+ *  
+ *    channel (2 bytes, high byte first)
+ *    deemphassis
+ *    band
+ *    spacing
+ *    CRC16 (2 bytes, high byte first) of the above using _crc16_update() starting at 0
  *    
- *  Checksum handled by higher frame layer. 
+ *  The TPR checks the CRC and the ranges and then writes the params into both the 
+ *  working and factory EEPROM blocks. It gives a long blink when it got a good frame. 
+ *  Only early firmware speaks version 1. Current firmware speaks version 2 (below).
  *  
  *  If you ever wait longer than 40ms for a pulse, then you abort the byte and frame and start seaching again.
  *  
@@ -61,20 +116,64 @@ void setup() {
  * 
  */
 
+/**
+ * 
+ *  TPR EEPROM programming protocol version 2
+ *  =========================================
+ *  
+ *  Same idea, but everything is sent as the time between the starts of 1ms dips. The unit of 
+ *  time T is a bit more than the board needs to recover from a dip. Each interval is...
+ *  
+ *    T + k*T/4
+ *    
+ *  ...where the symbol k carries 2 bits. A copy of a frame is...
+ *  
+ *    preamble    8 dips with k=0. TPR locks onto T from these, so T can change from frame to frame.
+ *    delimiter   k=4
+ *    7 bytes     Same bytes as version 1. Each is 4 symbols of 2 bits (MSB pair first) and then a parity 
+ *                symbol (k=0 if even number of 1 bits, k=2 if odd).
+ *                
+ *  There is no way for the TPR to ask for a resend, so we send `copies` copies of each frame back to back
+ *  (C command). The TPR keeps every byte that passes parity, so a bad bit only costs that one byte from the 
+ *  next copy, or from the next frame if you just press ENTER again. 
+ *  
+ *  One copy is about 57T, so at the default T of 10ms and one copy a frame takes about 0.57s. A version 1 
+ *  frame is 56 bits of 20ms, about 1.12s. More copies or a longer T are slower than version 1, so only 
+ *  use them for boards that keep missing bytes.
+ *  
+ *  With SENSE_PIN we measure the recovery time with a few dips before the preamble. Otherwise T is 
+ *  whatever was set with the T command. Keep T between T_MIN_US and T_MAX_US, the TPR can't time outside that. 
+ *  
+ *  When the TPR goes into programming mode it blinks the version it speaks.
+ *  The receive side is in Firmware/VccProg.c. 
+ * 
+ */
+
+#define T_MIN_US  4000
+#define T_MAX_US 20000
+
+#define COPIES_MAX 3
+
+uint8_t copies = 1;                   // Version 2 copies of each frame
+
+unsigned long t_us = 10000;           // Version 2 unit of time
+
+unsigned long lastDip;                // micros() at the start of the last dip
+
 
 void sendbit(int b) {
 
-    PORTC = 0b00000000;         // Send sync pulse
+    linesLow();                 // Send sync pulse
     delay(1);
-    PORTC = 0b00000111;
+    linesHigh();
     delay(9);
 
      
     if (b) {
 
-      PORTC = 0b00000000;
+      linesLow();
       delay(1);
-      PORTC = 0b00000111;
+      linesHigh();
       delay(9);
 
     } else {
@@ -120,9 +219,6 @@ void sendpacket( uint16_t channel  , uint8_t band, uint8_t deemphassis , uint8_t
   sendbyte( channel & 0xff );
   crc = _crc16_update(crc, channel & 0xff );    
 
-/*
-
-
   sendbyte( deemphassis );
   crc = _crc16_update(crc, deemphassis );  
 
@@ -135,17 +231,144 @@ void sendpacket( uint16_t channel  , uint8_t band, uint8_t deemphassis , uint8_t
   sendbyte( spacing );
   crc = _crc16_update(crc, spacing );    
 
-  */
-
   sendbyte( crc >> 8 );
   sendbyte( crc & 0xff );
+
+  delay(50);                    // Idle between frames
       
 }
 
-void sendprogramming( float station  , uint8_t band, uint8_t deemphassis , uint8_t spacing ) {
+// Version 2
+
+void dip() {
+  lastDip = micros();
+  linesLow();
+  delay(1);
+  linesHigh();
+}
+
+// Dip T + k*T/4 after the start of the last dip
+
+void sendsymbol( uint8_t k ) {
+
+  unsigned long interval = t_us + ((k * t_us) / 4);
+
+  while (micros() - lastDip < interval);
+
+  dip();
+
+}
+
+void sendbyte2(uint8_t b) {
+
+  uint8_t parity = 0;
+
+  for( int shift=6 ; shift>=0 ; shift-=2 ) {
+
+    uint8_t k = (b >> shift) & 0x03;
+
+    sendsymbol( k );
+
+    parity ^= k ^ (k>>1);
+
+  }
+
+  sendsymbol( (parity & 1) << 1 );
+
+}
+
+#ifdef SENSE_PIN
+
+// Dip a few times and find how long the board takes to get back to about 94% of idle, then add 
+// some margin. Receiver will not lock onto these since they are too few and too far apart.
+
+unsigned long calibrate() {
+
+  unsigned long worst = 0;
+
+  for( int i=0 ; i<3 ; i++ ) {
+
+    int idle = analogRead( SENSE_PIN );
+
+    dip();
+
+    while ( analogRead( SENSE_PIN ) < idle - (idle/16) && micros() - lastDip < T_MAX_US );
+
+    unsigned long recovery = micros() - lastDip;
+
+    if (recovery > worst) worst = recovery;
+
+    while (micros() - lastDip < T_MAX_US);        // Let it all the way back up before next one
+
+  }
+
+  return constrain( worst + (worst/2) , T_MIN_US , T_MAX_US );
+
+}
+
+#endif
+
+void sendpacket2( uint16_t channel  , uint8_t band, uint8_t deemphassis , uint8_t spacing ) {
+
+  uint8_t frame[] = { (uint8_t) (channel >> 8) , (uint8_t) (channel & 0xff) , deemphassis , band , spacing , 0 , 0 };
+
+  uint16_t crc = 0x0000;
+
+  for( int i=0 ; i<5 ; i++ ) {
+    crc = _crc16_update(crc, frame[i] );
+  }
+
+  frame[5] = crc >> 8;
+  frame[6] = crc & 0xff;
+
+#ifdef SENSE_PIN
+  t_us = calibrate();
+  Serial.print(" T=");
+  Serial.print( t_us );
+  Serial.print( "us..." );
+#endif
 
-  const float base[]  = { 87.5, 76, 76};            // Base freqenecy based on band
-  const float step[] = {  0.20 , 0.10 , 0.05 };     // Freqnecy step based on spacing
+  lastDip = micros();
+
+  for( int c=0 ; c<copies; c++ ) {
+
+    for( int i=0 ; i<8 ; i++ ) {
+      sendsymbol( 0 );          // Preamble
+    }
+
+    sendsymbol( 4 );            // Delimiter
+
+    for( int i=0 ; i<sizeof(frame) ; i++ ) {
+      sendbyte2( frame[i] );
+    }
+
+  }
+
+  delay(50);                    // Idle between frames
+
+}
+
+uint8_t protocol = 2;           // Which version to send, must match what the TPR blinks 
+
+const float base[]  = { 87.5, 76, 76};            // Base freqenecy based on band
+const float top[]   = { 108 , 108 , 90 };         // Top of band
+const float step[] = {  0.20 , 0.10 , 0.05 };     // Freqnecy step based on spacing
+
+// Same checks the TPR does on its end, plus the station has to be in the band. 
+// Returns a reason if not or NULL if it is fine.
+
+const char *checkRecord( float station  , uint8_t band, uint8_t deemphassis , uint8_t spacing ) {
+
+  if (band>2)                                   return "bad band";
+  if (deemphassis>1)                            return "bad deemphassis";
+  if (spacing>2)                                return "bad spacing";
+  if (station<base[band] || station>top[band])  return "station not in band";
+
+  return NULL;
+
+}
+
+void sendprogramming( float station  , uint8_t band, uint8_t deemphassis , uint8_t spacing ) {
 
   Serial.print(" computed channel=");
 
@@ -154,7 +377,11 @@ void sendprogramming( float station  , uint8_t band, uint8_t deemphassis , uint8
   Serial.print( channel );
   Serial.print( "..." );
 
-  sendpacket( channel , band, deemphassis , spacing ); 
+  if (protocol==1) {
+    sendpacket( channel , band, deemphassis , spacing ); 
+  } else {
+    sendpacket2( channel , band, deemphassis , spacing ); 
+  }
 
 }
 
@@ -195,6 +422,116 @@ int readLine(char *buffer , int size) {
 
 #define BUFFER_LEN 20
 
+// Batch mode. Read one record per line as "slot station band deemphassis spacing" until an empty line,
+// then program them all. Slots with the same record get programmed at the same time. 
+// There is no way for a TPR to answer back, so a slot passes if its record was good and got sent. 
+// Watch for the long blink on each unit to be sure.
+
+struct record {
+  float station;
+  uint8_t band, deemphassis, spacing;
+};
+
+void batch() {
+
+  record records[SLOTS];
+  uint8_t loaded = 0;               // Slots that have a record
+  const char *result[SLOTS];
+
+  char buffer[BUFFER_LEN+1];
+
+  Serial.println("Batch. Enter \"slot station band deemphassis spacing\" per line, empty line to run.");
+
+  while (1) {
+
+    readLine( buffer , BUFFER_LEN );
+    Serial.println("");
+
+    if (!buffer[0]) break;
+
+    char *slot = strtok( buffer , " ," );
+    char *station = strtok( NULL , " ," );
+    char *band = strtok( NULL , " ," );
+    char *deemphassis = strtok( NULL , " ," );
+    char *spacing = strtok( NULL , " ," );
+
+    if (!spacing || atoi(slot)<0 || atoi(slot)>=SLOTS) {
+      Serial.println("Don't understand, try again.");
+      continue;
+    }
+
+    int i = atoi(slot);
+
+    records[i].station = atof( station );
+    records[i].band = atoi( band );
+    records[i].deemphassis = atoi( deemphassis );
+    records[i].spacing = atoi( spacing );
+
+    result[i] = checkRecord( records[i].station , records[i].band , records[i].deemphassis , records[i].spacing );
+
+    loaded |= (1<<i);
+
+  }
+
+  uint8_t todo = loaded;
+
+  for( int i=0 ; i<SLOTS ; i++ ) {
+
+    if (!(todo & (1<<i))) continue;
+
+    // Gather up every slot with exactly the same good record and do them all at once
+
+    uint8_t group = 0;
+
+    for( int j=i ; j<SLOTS ; j++ ) {
+      if ( (todo & (1<<j)) && !result[j] && !result[i] && !memcmp( &records[i] , &records[j] , sizeof( record ) ) ) {
+        group |= (1<<j);
+      }
+    }
+
+    todo &= ~group;
+    todo &= ~(1<<i);
+
+    if (group) {
+
+      Serial.print("Programming slots");
+      for( int j=0 ; j<SLOTS ; j++ ) {
+        if (group & (1<<j)) {
+          Serial.print(" ");
+          Serial.print(j);
+        }
+      }
+
+      selectSlots( group );
+      sendprogramming( records[i].station , records[i].band , records[i].deemphassis , records[i].spacing );
+      Serial.println("done.");
+
+    }
+  }
+
+  selectSlots( 1 );                 // Back to just slot 0 for single unit mode
+
+  // Nothing comes back from the units, so "sent" only means the record was good and the frames went out.
+  // Check each unit's long blink to know it took.
+
+  for( int i=0 ; i<SLOTS ; i++ ) {
+
+    Serial.print("Slot ");
+    Serial.print(i);
+
+    if (!(loaded & (1<<i))) {
+      Serial.println(": empty");
+    } else if (result[i]) {
+      Serial.print(": bad record, not sent ");
+      Serial.println(result[i]);
+    } else {
+      Serial.println(": sent (not verified, check for the long blink)");
+    }
+
+  }
+
+}
+
 void loop() {
 
   //delay(500);
@@ -207,8 +544,8 @@ void loop() {
 
   while (1) {
 
-    Serial.println("TPR one-touch programmer");       
-    Serial.println("========================");
+    Serial.println("TPR one-touch programmer (protocol version 2, version 1 only for older firmware)");       
+    Serial.println("=================================================================================");
     
     Serial.print("S-Station    [");
     Serial.print(station);
@@ -226,6 +563,22 @@ void loop() {
     Serial.print(spacing);
     Serial.println("]");
 
+    Serial.print("V-Version    [");
+    Serial.print(protocol);
+    Serial.println("]");
+
+#ifndef SENSE_PIN
+    Serial.print("T-T (us, v2) [");
+    Serial.print(t_us);
+    Serial.println("]");
+#endif
+
+    Serial.print("C-Copies (v2)[");
+    Serial.print(copies);
+    Serial.println("]");
+
+
+    Serial.println("J-batch Job");
 
     Serial.println("");
     Serial.println("ENTER-Program it!");
@@ -253,21 +606,44 @@ void loop() {
           break;
 
         case 'B':
-          band=buffer[0]-'0';
+          band=buffer[1]-'0';
           Serial.println("Band set.");
           break;
 
         case 'D':
-          deemphassis=buffer[0]-'0';
+          deemphassis=buffer[1]-'0';
           Serial.println("Deemphassis set.");
           break;
 
         case 'P':
-          spacing=buffer[0]-'0';
+          spacing=buffer[1]-'0';
           Serial.println("Spacing set.");
           break;
 
 
+        case 'J':
+          batch();
+          break;
+
+        case 'V':
+          if (buffer[1]=='1' || buffer[1]=='2') {
+            protocol=buffer[1]-'0';
+            Serial.println("Version set.");
+          } else {
+            Serial.println("Version must be 1 (older firmware only) or 2.");
+          }
+          break;
+
+        case 'T':
+          t_us=constrain( String(buffer+1).toInt() , T_MIN_US , T_MAX_US );
+          Serial.println("T set.");
+          break;
+
+        case 'C':
+          copies=constrain( buffer[1]-'0' , 1 , COPIES_MAX );
+          Serial.println("Copies set.");
+          break;
+
        default:
           Serial.print("Don't understand [");
           Serial.print(buffer);         